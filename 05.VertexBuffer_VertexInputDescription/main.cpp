@@ -1,10 +1,14 @@
 ﻿#define NOMINMAX   // limits.hのmax()定義がminwindef.hに上書きされるのを防ぐ
 
+#ifdef _WIN32
 #define VK_USE_PLATFORM_WIN32_KHR
+#endif
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
+#ifdef _WIN32
 #define GLFW_EXPOSE_NATIVE_WIN32
 #include <GLFW/glfw3native.h>
+#endif
 
 
 #include <iostream>
@@ -17,7 +21,20 @@
 #include <algorithm>
 #include <fstream>
 #include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
 #include <array>
+#include <deque>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <atomic>
+#include <sstream>
+#include <iomanip>
+#include <random>
 
 using namespace std;
 using namespace glm;
@@ -25,11 +42,79 @@ using namespace glm;
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 600;
 
-// 適切な並列フレーム数を設定することでGPU負荷を最適化
-// 並列フレーム数が多すぎるとGPU負荷過大、フレーム遅延(latency)増加
-// 並列フレーム数が少なすぎるとGPU利用率低下、フレームレート低下
-// この値は負荷に基づき動的に計算可能
-const int MAX_FRAMES_IN_FLIGHT = 2; 
+// 表示モードの選択方針 利用できるモードを優先順に試し、どれもなければ必ずサポートされるFIFOになる
+enum class PresentPolicy
+{
+    LowLatency,  // MAILBOX > IMMEDIATE > FIFO 垂直同期を待たずに最新のフレームを表示する
+    PowerSaving, // FIFO 垂直同期に合わせ、リフレッシュレート以上に描画しない
+    FifoRelaxed, // FIFO_RELAXED > FIFO リフレッシュに間に合わなかったフレームはティアリングを許して即座に表示する
+};
+
+// コマンドバッファの記録方式
+enum class CommandRecordMode
+{
+    PerFrame,    // 毎フレームリセットして記録し直す
+    PreRecorded, // スワップチェーンイメージごとに事前記録し、スワップチェーンの再作成時とパイプライン完成時だけ記録し直す
+    Secondary,   // 毎フレーム、描画をワーカースレッドに分割してセカンダリコマンドバッファに記録する
+};
+
+// コマンドライン引数または設定ファイル（--config FILE）で指定する実行時設定
+// 設定ファイルは1行に1つ「キー=値」を書く（キーはコマンドラインのオプション名から--を除いたもの、#以降はコメント）
+struct AppConfig
+{
+    bool headless = false;         // --headless ウィンドウ・サーフェスを作らず、オフスクリーンイメージに描画する（ベンチマーク用）
+    uint32_t benchmarkFrames = 1000; // --frames N ヘッドレス時に描画するフレーム数
+    string traceFile;              // --trace FILE 終了時にCPUプロファイルをChrome trace形式で出力する
+
+    // --frames-in-flight N 適切な並列フレーム数を設定することでGPU負荷を最適化
+    // 並列フレーム数が多すぎるとGPU負荷過大、フレーム遅延(latency)増加
+    // 並列フレーム数が少なすぎるとGPU利用率低下、フレームレート低下
+    uint32_t framesInFlight = 2;
+
+    // --swapchain-images N 要求するスワップチェーンイメージ数 0ならminImageCount + 1
+    // サーフェスが許す範囲に丸められる
+    uint32_t swapchainImages = 0;
+
+    PresentPolicy presentPolicy = PresentPolicy::LowLatency; // --present-mode latency|power|fifo_relaxed
+    double fpsLimit = 0.0; // --fps-limit N CPU側でフレームの開始間隔を揃える 0なら制限しない
+    string gpu;            // --gpu NAME|UUID|INDEX 使用する物理デバイスを明示的に指定する（空ならスコアが最も高いもの）
+
+    CommandRecordMode recordMode = CommandRecordMode::PreRecorded; // --record-mode perframe|prerecorded|secondary 記録方式の比較用
+
+    // --direct-upload 0|1 DEVICE_LOCAL | HOST_VISIBLEのメモリがあれば（ReBAR・統合GPU）、ステージングを介さず最終バッファに直接書き込む
+    bool directUpload = true;
+
+    bool meshOptimize = true;     // --mesh-optimize 0|1 アップロード前に頂点キャッシュ・頂点フェッチ向けにメッシュを並べ替える
+    float overdrawThreshold = 0.0f; // --overdraw-threshold X オーバードロー削減の並べ替えで許すACMRの悪化率（1.05など） 0なら行わない
+
+    uint32_t instanceCount = 1; // --instances N シーンに並べるオブジェクト数 同じメッシュのオブジェクトは1回のインスタンス描画になる
+
+    // --indirect 0|1 描画コマンドをVkDrawIndexedIndirectCommandのバッファに格納し、インデックス型ごとに1回の間接描画で発行する
+    bool indirectDraws = true;
+};
+
+const uint32_t MAX_FRAMES_IN_FLIGHT_LIMIT = 8; // framesInFlightの上限
+
+// セカンダリコマンドバッファ1つあたりの最小描画数 これより細かく分けるとスレッドの切り替えコストが上回る
+const uint32_t MIN_DRAWS_PER_RECORD_JOB = 64;
+
+// アップロード用ステージングリングの容量。これより大きいデータは一時的なステージングバッファで転送する
+const VkDeviceSize STAGING_RING_SIZE = 8 * 1024 * 1024;
+
+// ヒープ使用量が予算のこの割合を超えたら警告を出す
+const double MEMORY_BUDGET_WARNING_RATIO = 0.9;
+
+// VK_EXT_memory_budgetが無い場合、ヒープサイズのこの割合を予算とみなす（他プロセスやドライバの使用分を見込む）
+const double MEMORY_BUDGET_FALLBACK_RATIO = 0.8;
+
+// この間隔ごとに直近のフレーム統計を出力する
+const double FRAME_STATS_REPORT_SECONDS = 5.0;
+
+// パーセンタイル計算用に保持するフレーム数の上限 これを超えると無作為抽出（リザーバサンプリング）した標本で近似する
+const size_t FRAME_STATS_RESERVOIR_SIZE = 4096;
+
+// パイプラインキャッシュの保存先 次回起動時に読み込み、シェーダの再コンパイルを省く
+const string PIPELINE_CACHE_FILE = "pipeline_cache.bin";
 
 const vector<const char*> requiredLayers =
 {
@@ -48,36 +133,145 @@ struct SwapChainSupportDetails
     vector<VkPresentModeKHR> presentModes;
 };
 
-struct Vertex 
+// 頂点属性として使う圧縮型 コンストラクタでfloatから変換し、GPU側は対応するVkFormatでfloatとして読み出す
+// シェーダの入力はfloatのまま変更不要（UNORM/SNORM/SFLOATの属性はvec*として読める）
+
+// 半精度float x2 位置などに使う 8バイト -> 4バイト
+struct Half2
+{
+    uint32_t packed = 0;
+
+    Half2() = default;
+    Half2(float x, float y) : packed(packHalf2x16(vec2(x, y))) {}
+};
+
+// 半精度float x4 3次元の位置などに使う（wは未使用でも4バイト境界に揃えるため持つ） 12/16バイト -> 8バイト
+struct Half4
 {
-    vec2 pos;
-    vec3 color;
+    uint64_t packed = 0;
 
-    static VkVertexInputBindingDescription getBindingDescription() 
+    Half4() = default;
+    Half4(float x, float y, float z, float w = 1.0f) : packed(packHalf4x16(vec4(x, y, z, w))) {}
+};
+
+// [0, 1]の8bit x4 頂点カラーに使う 12/16バイト -> 4バイト
+struct Unorm8x4
+{
+    uint32_t packed = 0;
+
+    Unorm8x4() = default;
+    Unorm8x4(float r, float g, float b, float a = 1.0f) : packed(packUnorm4x8(vec4(r, g, b, a))) {}
+};
+
+// [-1, 1]の10bit x3 + 2bit 法線・接線に使う（wは接線の向きの符号などに使える） 12バイト -> 4バイト
+struct Snorm10x3
+{
+    uint32_t packed = 0;
+
+    Snorm10x3() = default;
+    Snorm10x3(float x, float y, float z, float w = 0.0f) : packed(packSnorm3x10_1x2(vec4(x, y, z, w))) {}
+};
+
+// [-1, 1]の16bit x2 UVに使う（範囲外のUVは事前に正規化しておくこと） 8バイト -> 4バイト
+struct Snorm16x2
+{
+    uint32_t packed = 0;
+
+    Snorm16x2() = default;
+    Snorm16x2(float u, float v) : packed(packSnorm2x16(vec2(u, v))) {}
+};
+
+// CPU側の格納型に対応するVkFormat 新しい型を頂点属性に使う場合はここに特殊化を追加する
+// glmのpack関数はxを下位ビットに詰めるため、リトルエンディアンではR成分が先頭になるフォーマットと一致する
+template<typename T> struct VertexAttributeFormat;
+template<> struct VertexAttributeFormat<float>     { static constexpr VkFormat format = VK_FORMAT_R32_SFLOAT; };
+template<> struct VertexAttributeFormat<uint32_t>  { static constexpr VkFormat format = VK_FORMAT_R32_UINT; };
+template<> struct VertexAttributeFormat<vec2>      { static constexpr VkFormat format = VK_FORMAT_R32G32_SFLOAT; };
+template<> struct VertexAttributeFormat<vec3>      { static constexpr VkFormat format = VK_FORMAT_R32G32B32_SFLOAT; };
+template<> struct VertexAttributeFormat<vec4>      { static constexpr VkFormat format = VK_FORMAT_R32G32B32A32_SFLOAT; };
+template<> struct VertexAttributeFormat<Half2>     { static constexpr VkFormat format = VK_FORMAT_R16G16_SFLOAT; };
+template<> struct VertexAttributeFormat<Half4>     { static constexpr VkFormat format = VK_FORMAT_R16G16B16A16_SFLOAT; };
+template<> struct VertexAttributeFormat<Unorm8x4>  { static constexpr VkFormat format = VK_FORMAT_R8G8B8A8_UNORM; };
+template<> struct VertexAttributeFormat<Snorm10x3> { static constexpr VkFormat format = VK_FORMAT_A2B10G10R10_SNORM_PACK32; };
+template<> struct VertexAttributeFormat<Snorm16x2> { static constexpr VkFormat format = VK_FORMAT_R16G16_SNORM; };
+
+// 頂点構造体の1つのメンバーに対応する属性 VERTEX_FIELDで作る
+struct VertexField
+{
+    uint32_t location;
+    VkFormat format;
+    uint32_t offset;
+};
+
+// メンバーの型からフォーマット、offsetofからオフセットをコンパイル時に求める（手書きのフォーマット指定との食い違いを防ぐ）
+#define VERTEX_FIELD(VertexType, member, shaderLocation) \
+    VertexField{ shaderLocation, VertexAttributeFormat<decltype(VertexType::member)>::format, static_cast<uint32_t>(offsetof(VertexType, member)) }
+
+// VertexTypeはstatic constexprのgetFields()でVertexFieldの配列を返す
+// バインディングと属性の記述はそこから導出するため、メンバーを変えてもここを手で直す必要は無い
+template<typename VertexType>
+struct VertexLayout
+{
+    static constexpr auto fields = VertexType::getFields();
+    static constexpr size_t attributeCount = fields.size();
+
+    static VkVertexInputBindingDescription getBindingDescription(uint32_t binding = 0, VkVertexInputRate inputRate = VK_VERTEX_INPUT_RATE_VERTEX)
     {
         VkVertexInputBindingDescription bindingDescription{};
-        bindingDescription.binding = 0; // Buffer Index
-        bindingDescription.stride = sizeof(Vertex);
-        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        bindingDescription.binding = binding; // Buffer Index
+        bindingDescription.stride = sizeof(VertexType);
+        bindingDescription.inputRate = inputRate;
 
         return bindingDescription;
     }
 
-    static array<VkVertexInputAttributeDescription, 2> getAttributeDescriptions() 
+    static array<VkVertexInputAttributeDescription, attributeCount> getAttributeDescriptions(uint32_t binding = 0)
     {
-        array<VkVertexInputAttributeDescription, 2> attributeDescriptions{};
+        array<VkVertexInputAttributeDescription, attributeCount> attributeDescriptions{};
+        for (size_t i = 0; i < attributeCount; i++)
+        {
+            attributeDescriptions[i].binding = binding; // Buffer Index
+            attributeDescriptions[i].location = fields[i].location;
+            attributeDescriptions[i].format = fields[i].format;
+            attributeDescriptions[i].offset = fields[i].offset;
+        }
+
+        return attributeDescriptions;
+    }
+};
 
-        attributeDescriptions[0].binding = 0; // Buffer Index
-        attributeDescriptions[0].location = 0;
-        attributeDescriptions[0].format = VK_FORMAT_R32G32_SFLOAT;
-        attributeDescriptions[0].offset = offsetof(Vertex, pos);
+// 位置は半精度、カラーは8bit 20バイト -> 8バイト
+// シェーダ側はvec2 inPosition / vec3 inColorのまま（カラーのA成分は読み捨てられる）
+struct Vertex 
+{
+    Half2 pos;
+    Unorm8x4 color;
 
-        attributeDescriptions[1].binding = 0; // Buffer Index
-        attributeDescriptions[1].location = 1;
-        attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-        attributeDescriptions[1].offset = offsetof(Vertex, color);
+    static constexpr array<VertexField, 2> getFields()
+    {
+        return { {
+            VERTEX_FIELD(Vertex, pos, 0),
+            VERTEX_FIELD(Vertex, color, 1),
+        } };
+    }
+};
 
-        return attributeDescriptions;
+static_assert(sizeof(Vertex) == 8, "Vertex must be tightly packed");
+
+// インスタンスごとの属性 バインディング1（VK_VERTEX_INPUT_RATE_INSTANCE）から読み、インスタンスごとに1つ進む
+struct InstanceData
+{
+    vec4 transform; // xy: 平行移動 zw: 拡大率
+    Unorm8x4 color; // 頂点カラーに乗算する
+    uint32_t id;    // シーン内のオブジェクト番号（ピッキングやデバッグ表示用）
+
+    static constexpr array<VertexField, 3> getFields()
+    {
+        return { {
+            VERTEX_FIELD(InstanceData, transform, 2),
+            VERTEX_FIELD(InstanceData, color, 3),
+            VERTEX_FIELD(InstanceData, id, 4),
+        } };
     }
 };
 
@@ -89,7 +283,7 @@ const vector<Vertex> vertices =
     {{-0.5f, 0.5f}, {1.0f, 1.0f, 1.0f}}
 };
 
-const vector<uint16_t> indices = 
+const vector<uint32_t> indices = 
 {
     0, 1, 2, 2, 3, 0
 };
@@ -103,6 +297,52 @@ const bool enableValidationLayers = true;
 
 VkDebugUtilsMessengerEXT callback;
 
+// 1回のvkCmdDrawIndexedに対応する描画単位
+struct DrawItem
+{
+    uint32_t indexCount = 0;
+    uint32_t firstIndex = 0;
+    int32_t vertexOffset = 0;
+    VkIndexType indexType = VK_INDEX_TYPE_UINT16; // firstIndexはこの型のインデックス領域の先頭からの位置
+    uint32_t firstInstance = 0; // インスタンスバッファ内の先頭インスタンス
+    uint32_t instanceCount = 1;
+};
+
+// 同じインデックス型の連続する間接描画コマンド 1回のvkCmdDrawIndexedIndirect(Count)で発行する
+struct IndirectDrawGroup
+{
+    VkIndexType indexType = VK_INDEX_TYPE_UINT16;
+    uint32_t firstCommand = 0;
+    uint32_t commandCount = 0;
+};
+
+// シーン内の1つのオブジェクト 毎フレームInstanceDataに変換してインスタンスバッファに書き込む
+struct SceneObject
+{
+    uint32_t mesh = 0;     // MeshArenaのMeshRangeの番号
+    uint32_t pipeline = 0; // 使用するパイプライン（現在はgraphicsPipelineのみで0）
+    vec2 position = vec2(0.0f);
+    float scale = 1.0f;
+    vec3 color = vec3(1.0f);
+};
+
+// 同じメッシュ・同じパイプラインのオブジェクトをまとめた1回のインスタンス描画
+struct DrawBatch
+{
+    uint32_t mesh = 0;
+    uint32_t pipeline = 0;
+    uint32_t firstInstance = 0;
+    uint32_t instanceCount = 0;
+};
+
+// ratePhyicalDeviceの評価結果 reasonsは加点・不適格の理由（ログ出力用）
+struct PhysicalDeviceRating
+{
+    bool suitable = false;
+    int score = 0;
+    vector<string> reasons;
+};
+
 struct QueueFamilyIndices
 {
     // グラフィックスコマンド用のキュー族
@@ -111,99 +351,2528 @@ struct QueueFamilyIndices
     // 表示用のコマンドキュー族
     int presentFamily = -1;
 
+    // 転送専用のキュー族（DMAエンジン）。存在しない場合は-1のままで、graphicsFamilyで代用する
+    int transferFamily = -1;
+
+    // 非同期コンピュート用のキュー族（GRAPHICSを持たないCOMPUTE）。存在しない場合は-1
+    int computeFamily = -1;
+
     // 必要なキュー族が全てサポートされているか
-    bool isComplete()
+    bool isComplete() const
     {
         return graphicsFamily >= 0 && presentFamily >= 0;
     }
 };
 
-class HelloTriangleApplication
+// pickPhysicalDeviceで1度だけ構築する物理デバイス情報のスナップショット
+// 以降はvkGetPhysicalDevice*を呼び直さず、ここから読み出す
+struct DeviceCapabilities
+{
+    VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+    VkPhysicalDeviceProperties properties{};
+    VkPhysicalDeviceFeatures features{};
+    VkPhysicalDeviceMemoryProperties memoryProperties{};
+    vector<VkQueueFamilyProperties> queueFamilies;
+    QueueFamilyIndices queueFamilyIndices;
+    set<string> extensions;          // サポートされているデバイス拡張
+    string deviceUUID;               // Vulkan 1.0のデバイスでは空
+    bool indexTypeUint8 = false;     // VK_EXT_index_type_uint8のindexTypeUint8機能
+    vector<VkSurfaceFormatKHR> surfaceFormats; // ヘッドレス時は空
+    vector<VkPresentModeKHR> presentModes;     // ヘッドレス時は空
+    mutable map<VkFormat, VkFormatProperties> formatProperties; // 問い合わせ済みのフォーマット
+
+    bool hasExtension(const char* name) const
+    {
+        return extensions.count(name) != 0;
+    }
+
+    // フォーマットの対応状況は変わらないため、初回の問い合わせ結果を保持する
+    const VkFormatProperties& getFormatProperties(VkFormat format) const
+    {
+        auto it = formatProperties.find(format);
+        if (it == formatProperties.end())
+        {
+            VkFormatProperties properties;
+            vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &properties);
+            it = formatProperties.emplace(format, properties).first;
+        }
+        return it->second;
+    }
+};
+
+// DeviceMemoryAllocatorが返すサブアロケーション
+// VkDeviceMemoryは大きなブロック単位で確保し、各バッファはブロック内のoffsetで区別する
+struct MemoryAllocation
+{
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    uint32_t memoryTypeIndex = 0;
+    uint32_t blockIndex = 0;
+    void* mappedData = nullptr; // HOST_VISIBLEの場合、永続マップ済みのアドレス（offset適用済み）
+};
+
+struct MemoryAllocatorStats
+{
+    VkDeviceSize liveBytes = 0;        // 使用中のバイト数
+    VkDeviceSize reservedBytes = 0;    // 確保済みブロックの合計バイト数
+    VkDeviceSize freeBytes = 0;        // ブロック内の空きバイト数
+    VkDeviceSize largestFreeRange = 0; // 最大の連続空き領域
+    uint32_t blockCount = 0;
+    uint32_t allocationCount = 0;
+    float fragmentation = 0.0f;        // 1 - 最大空き領域 / 空き領域合計（0なら断片化なし）
+};
+
+// ヒープごとの使用量と予算
+struct MemoryHeapBudget
+{
+    VkDeviceSize size = 0;
+    VkDeviceSize usage = 0;  // VK_EXT_memory_budgetがあればプロセス全体の使用量、無ければアロケータが確保したブロックの合計
+    VkDeviceSize budget = 0; // このプロセスが使ってよい量の目安 超えるとOSによる退避やvkAllocateMemoryの失敗が起こりうる
+    bool deviceLocal = false;
+};
+
+// vkAllocateMemoryの呼び出し回数はmaxMemoryAllocationCount（4096程度）に制限され、呼び出し自体も重い
+// そのため、メモリタイプごとに大きなVkDeviceMemoryブロックを確保し、その中からバッファを切り出す
+// 空き領域はサイズ順のフリーリスト（best-fit）で管理し、解放時に隣接する空き領域と結合する
+class DeviceMemoryAllocator
 {
 public:
-    void run()
+    // memoryBudgetEnabled: VK_EXT_memory_budgetを有効にしてデバイスを作成した場合true
+    void init(VkDevice device, const DeviceCapabilities& deviceCaps, bool memoryBudgetEnabled, VkDeviceSize preferredBlockSize = 64 * 1024 * 1024)
     {
-        initWindow();
-        initVulkan();
-        mainLoop();
-        cleanup();
+        this->device = device;
+        this->physicalDevice = deviceCaps.physicalDevice;
+        this->memoryBudgetEnabled = memoryBudgetEnabled;
+        this->preferredBlockSize = preferredBlockSize;
+
+        memProperties = deviceCaps.memoryProperties;
+        bufferImageGranularity = deviceCaps.properties.limits.bufferImageGranularity;
+        maxAllocationCount = deviceCaps.properties.limits.maxMemoryAllocationCount;
+
+        freeLists.resize(memProperties.memoryTypeCount);
+        blockCounts.assign(memProperties.memoryTypeCount, 0);
+        heapReservedBytes.assign(memProperties.memoryHeapCount, 0);
+        heapBudgets.resize(memProperties.memoryHeapCount);
+        heapWarned.assign(memProperties.memoryHeapCount, false);
+
+        updateBudgets();
     }
 
-private:
-    GLFWwindow* window;
-    VkInstance instance;
-    VkDebugUtilsMessengerEXT callback;
-    VkPhysicalDevice physicalDevice = VK_NULL_HANDLE; // physicalDevice は instance に紐づくため、instance 解放時に自動解放される（明示的解放不要）
-    VkDevice device = VK_NULL_HANDLE; // 論理デバイスの作成時にcreateinfoを使用するため、明示的に解放する必要があります
-    VkQueue graphicsQueue; // コマンドキューは論理デバイスの作成時に生成され、deviceの解放時に自動的に解放されます（明示的な解放不要）
-    VkQueue presentQueue;
-    VkSurfaceKHR surface;
-    VkSwapchainKHR swapChain;
-    vector<VkImage> swapChainImages;
-    VkFormat swapChainImageFormat;
-    VkExtent2D swapChainExtent;
-    vector<VkImageView> swapChainImageViews;
-    VkPipelineLayout pipelineLayout; // 固定機能の管理に使用
-    VkRenderPass renderPass;
-    VkPipeline graphicsPipeline;
-    vector<VkFramebuffer> swapChainFramebuffers;  // 1つのattachmentが複数のswapchain画像に対応する可能性があるため、複数のframebufferが必要
-    VkCommandPool commandPool; // コマンドプールはCommand Bufferの割り当て・管理用メモリコンテナ
-    
-    VkBuffer vertexBuffer; // 論理バッファオブジェクト バッファの論理属性と用途を定義
-    VkDeviceMemory vertexBufferMemory; // 実際のメモリ割り当てと管理（VRAMまたはホストメモリ）、データ格納
-    VkBuffer indexBuffer;  // / vertexBufferと同様だが、インデックスバッファは1つしか持たず、そのインデックス値は全ての頂点属性（位置、法線、UV座標など）に適用される
-    VkDeviceMemory indexBufferMemory;
-    
-    vector <VkCommandBuffer> commandBuffers; // Command BufferはGPUコマンド格納用コンテナ（描画/計算/メモリ操作命令記録用）
+    // linear: バッファやLINEARイメージはtrue、OPTIMALイメージはfalse
+    MemoryAllocation allocate(const VkMemoryRequirements& requirements, uint32_t memoryTypeIndex, bool linear = true)
+    {
+        MemoryAllocation allocation;
+        if (!tryAllocate(requirements, memoryTypeIndex, linear, allocation))
+        {
+            throw runtime_error("failed to allocate device memory within budget!");
+        }
 
-    // VulkanのAPI呼び出しの大部分は非同期であるため、明示的に同期を実装する必要があります
-    vector <VkSemaphore> imageAvailableSemaphores; // GPU内の各コマンド間の同期を実現
-    vector <VkSemaphore> renderFinishedSemaphores; // GPU内の各コマンド間の同期を実現
-    vector <VkFence> inFlightFences; // CPUとGPU間の同期を実現
-    uint32_t currentFrame = 0; // 現在処理中の並列フレームを識別
+        return allocation;
+    }
 
-    bool framebufferResized = false;
+    // 新しいブロックがヒープの予算を超える場合やvkAllocateMemoryがメモリ不足で失敗した場合はfalseを返す
+    // 呼び出し側は別のメモリタイプへ逃がすか、確保を諦めることができる
+    bool tryAllocate(const VkMemoryRequirements& requirements, uint32_t memoryTypeIndex, bool linear, MemoryAllocation& allocation)
+    {
+        VkDeviceSize alignment = requirements.alignment;
+        VkDeviceSize size = requirements.size;
 
-    void initWindow()
+        // 線形リソースと非線形リソースが同じbufferImageGranularityページを共有するとエイリアシング扱いになる
+        // 非線形リソースの先頭と末尾をページ境界に揃えることで、隣接する線形リソースとの共有を防ぐ
+        if (!linear)
+        {
+            alignment = std::max(alignment, bufferImageGranularity);
+            size = alignUp(size, bufferImageGranularity);
+        }
+
+        if (!allocateFromFreeList(memoryTypeIndex, size, alignment, allocation))
+        {
+            // 既存ブロックに収まらない場合は新しいブロックを確保（ブロックより大きい要求は専用ブロック）
+            // 予算に余裕が無い場合は、既定サイズのブロックを諦めて要求サイズちょうどのブロックを試す
+            VkDeviceSize blockSize = std::max(getBlockSize(memoryTypeIndex), size);
+            if (!createBlock(memoryTypeIndex, blockSize) && (blockSize == size || !createBlock(memoryTypeIndex, size)))
+            {
+                return false;
+            }
+
+            if (!allocateFromFreeList(memoryTypeIndex, size, alignment, allocation))
+            {
+                throw runtime_error("failed to sub-allocate device memory!");
+            }
+        }
+
+        liveBytes += allocation.size;
+        allocationCount++;
+
+        return true;
+    }
+
+    // VK_EXT_memory_budgetの値はvkGetPhysicalDeviceMemoryProperties2を呼んだ時点で更新されるため、ブロック確保前と定期的に呼ぶ
+    void updateBudgets()
     {
-        glfwInit();
+        VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties{};
+        budgetProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
 
-        glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API); // GLFWが自動的にOpenGLコンテキストを作成しないように設定する
+        if (memoryBudgetEnabled)
+        {
+            VkPhysicalDeviceMemoryProperties2 memProperties2{};
+            memProperties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+            memProperties2.pNext = &budgetProperties;
+            vkGetPhysicalDeviceMemoryProperties2(physicalDevice, &memProperties2);
+        }
 
-        window = glfwCreateWindow(WIDTH, HEIGHT, "koalahjf@gmail.com", nullptr, nullptr);
-        glfwSetWindowUserPointer(window, this);
-        glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+        for (uint32_t i = 0; i < memProperties.memoryHeapCount; i++)
+        {
+            MemoryHeapBudget& heapBudget = heapBudgets[i];
+            heapBudget.size = memProperties.memoryHeaps[i].size;
+            heapBudget.deviceLocal = (memProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0;
+
+            if (memoryBudgetEnabled)
+            {
+                heapBudget.usage = budgetProperties.heapUsage[i];
+                heapBudget.budget = budgetProperties.heapBudget[i];
+            }
+            else
+            {
+                // 他プロセスの使用量は分からないため、自分の確保分とヒープサイズから見積もる
+                heapBudget.usage = heapReservedBytes[i];
+                heapBudget.budget = static_cast<VkDeviceSize>(heapBudget.size * MEMORY_BUDGET_FALLBACK_RATIO);
+            }
+
+            // 警告は閾値を超えた時に1度だけ出し、下回ったら再び出せるようにする
+            bool nearBudget = heapBudget.usage > heapBudget.budget * MEMORY_BUDGET_WARNING_RATIO;
+            if (nearBudget && !heapWarned[i])
+            {
+                cout << "Memory Budget Warning: heap " << i << " uses " << (heapBudget.usage >> 20) << " MiB of "
+                     << (heapBudget.budget >> 20) << " MiB budget" << endl;
+            }
+            heapWarned[i] = nearBudget;
+        }
     }
 
-    // VK_ERROR_OUT_OF_DATE_KHRはリサイズ発生を保証しないため、glfwSetFramebufferSizeCallbackで明示的に処理する必要がある
-    static void framebufferResizeCallback(GLFWwindow* window, int width, int height) 
+    const vector<MemoryHeapBudget>& getBudgets() const
     {
-        auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
-        app->framebufferResized = true;
+        return heapBudgets;
     }
 
+    uint32_t getHeapIndex(uint32_t memoryTypeIndex) const
+    {
+        return memProperties.memoryTypes[memoryTypeIndex].heapIndex;
+    }
 
-    void initVulkan()
+    void printBudgets() const
+    {
+        cout << "Memory Budget (" << (memoryBudgetEnabled ? "VK_EXT_memory_budget" : "heap size estimate") << "):" << endl;
+        for (uint32_t i = 0; i < heapBudgets.size(); i++)
+        {
+            const MemoryHeapBudget& heapBudget = heapBudgets[i];
+            cout << "\theap " << i << (heapBudget.deviceLocal ? " (device-local)" : "") << ": "
+                 << (heapBudget.usage >> 20) << " / " << (heapBudget.budget >> 20) << " MiB used, "
+                 << (heapReservedBytes[i] >> 20) << " MiB reserved by allocator, heap " << (heapBudget.size >> 20) << " MiB" << endl;
+        }
+    }
+
+    void release(MemoryAllocation& allocation)
+    {
+        if (allocation.memory == VK_NULL_HANDLE)
+            return;
+
+        uint32_t blockIndex = allocation.blockIndex;
+        Block& block = blocks[blockIndex];
+        VkDeviceSize offset = allocation.offset;
+        VkDeviceSize size = allocation.size;
+
+        // 後ろの空き領域と結合
+        auto next = block.freeRanges.find(offset + size);
+        if (next != block.freeRanges.end())
+        {
+            size += next->second->first;
+            eraseFreeRange(blockIndex, next);
+        }
+
+        // 前の空き領域と結合
+        auto prev = block.freeRanges.lower_bound(offset);
+        if (prev != block.freeRanges.begin())
+        {
+            --prev;
+            VkDeviceSize prevSize = prev->second->first;
+            if (prev->first + prevSize == offset)
+            {
+                offset = prev->first;
+                size += prevSize;
+                eraseFreeRange(blockIndex, prev);
+            }
+        }
+
+        insertFreeRange(blockIndex, offset, size);
+
+        block.allocationCount--;
+        liveBytes -= allocation.size;
+        allocationCount--;
+
+        // 空になったブロックは解放する。ただし確保・解放の繰り返しを避けるため、メモリタイプごとに最低1つは残す
+        if (block.allocationCount == 0 && blockCounts[block.memoryTypeIndex] > 1)
+        {
+            destroyBlock(blockIndex);
+        }
+
+        allocation = MemoryAllocation{};
+    }
+
+    MemoryAllocatorStats getStats() const
+    {
+        MemoryAllocatorStats stats;
+        stats.liveBytes = liveBytes;
+        stats.allocationCount = allocationCount;
+
+        for (const auto& block : blocks)
+        {
+            if (block.memory == VK_NULL_HANDLE)
+                continue;
+
+            stats.blockCount++;
+            stats.reservedBytes += block.size;
+
+            for (const auto& range : block.freeRanges)
+            {
+                VkDeviceSize rangeSize = range.second->first;
+                stats.freeBytes += rangeSize;
+                stats.largestFreeRange = std::max(stats.largestFreeRange, rangeSize);
+            }
+        }
+
+        if (stats.freeBytes > 0)
+        {
+            stats.fragmentation = 1.0f - static_cast<float>(stats.largestFreeRange) / static_cast<float>(stats.freeBytes);
+        }
+
+        return stats;
+    }
+
+    void printStats() const
+    {
+        MemoryAllocatorStats stats = getStats();
+
+        cout << "Memory Allocator Stats:" << endl;
+        cout << "\tblocks: " << stats.blockCount << " (" << stats.reservedBytes << " bytes reserved)" << endl;
+        cout << "\tallocations: " << stats.allocationCount << " (" << stats.liveBytes << " bytes live)" << endl;
+        cout << "\tfree: " << stats.freeBytes << " bytes, largest range: " << stats.largestFreeRange << " bytes" << endl;
+        cout << "\tfragmentation: " << stats.fragmentation << endl;
+
+        printBudgets();
+    }
+
+    void destroy()
+    {
+        for (uint32_t i = 0; i < blocks.size(); i++)
+        {
+            if (blocks[i].memory != VK_NULL_HANDLE)
+            {
+                destroyBlock(i);
+            }
+        }
+
+        blocks.clear();
+        freeBlockIndices.clear();
+    }
+
+private:
+    typedef multimap<VkDeviceSize, pair<uint32_t, VkDeviceSize>> FreeList; // size -> (blockIndex, offset)
+
+    struct Block
+    {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize size = 0;
+        uint32_t memoryTypeIndex = 0;
+        uint32_t allocationCount = 0;
+        void* mappedData = nullptr;
+        // offset -> フリーリストの要素（サイズはその要素のキー） 隣接する空き領域の検索・結合と、フリーリストからのO(log n)の削除用
+        map<VkDeviceSize, FreeList::iterator> freeRanges;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties memProperties{};
+    bool memoryBudgetEnabled = false;
+    VkDeviceSize bufferImageGranularity = 1;
+    VkDeviceSize preferredBlockSize = 0;
+    uint32_t maxAllocationCount = 0;
+
+    vector<Block> blocks; // 解放済みブロックはmemory = VK_NULL_HANDLEのまま再利用し、blockIndexを安定させる
+    vector<uint32_t> freeBlockIndices; // memory = VK_NULL_HANDLEのblocksの添字
+    vector<FreeList> freeLists; // メモリタイプごと
+    vector<uint32_t> blockCounts; // メモリタイプごとの確保済みブロック数
+    uint32_t liveBlockCount = 0;
+
+    VkDeviceSize liveBytes = 0;
+    uint32_t allocationCount = 0;
+
+    vector<VkDeviceSize> heapReservedBytes; // ヒープごとのブロック合計
+    vector<MemoryHeapBudget> heapBudgets;
+    vector<bool> heapWarned;
+
+    static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    // 小さいヒープ（統合GPUのDEVICE_LOCALなど）ではヒープの1/8を上限とする
+    VkDeviceSize getBlockSize(uint32_t memoryTypeIndex) const
+    {
+        VkDeviceSize heapSize = memProperties.memoryHeaps[memProperties.memoryTypes[memoryTypeIndex].heapIndex].size;
+        return std::min(preferredBlockSize, heapSize / 8);
+    }
+
+    bool allocateFromFreeList(uint32_t memoryTypeIndex, VkDeviceSize size, VkDeviceSize alignment, MemoryAllocation& allocation)
+    {
+        auto& freeList = freeLists[memoryTypeIndex];
+
+        // サイズ以上で最小の空き領域から順に、アライメント調整後も収まるものを探す（best-fit）
+        for (auto it = freeList.lower_bound(size); it != freeList.end(); ++it)
+        {
+            VkDeviceSize rangeSize = it->first;
+            uint32_t blockIndex = it->second.first;
+            VkDeviceSize rangeOffset = it->second.second;
+
+            VkDeviceSize alignedOffset = alignUp(rangeOffset, alignment);
+            VkDeviceSize padding = alignedOffset - rangeOffset;
+            if (padding + size > rangeSize)
+                continue;
+
+            Block& block = blocks[blockIndex];
+            block.freeRanges.erase(rangeOffset);
+            freeList.erase(it);
+
+            // 前方のアライメント余白と後方の残りを空き領域として戻す
+            if (padding > 0)
+                insertFreeRange(blockIndex, rangeOffset, padding);
+
+            VkDeviceSize tail = rangeSize - padding - size;
+            if (tail > 0)
+                insertFreeRange(blockIndex, alignedOffset + size, tail);
+
+            block.allocationCount++;
+
+            allocation.memory = block.memory;
+            allocation.offset = alignedOffset;
+            allocation.size = size;
+            allocation.memoryTypeIndex = memoryTypeIndex;
+            allocation.blockIndex = blockIndex;
+            allocation.mappedData = block.mappedData ? static_cast<char*>(block.mappedData) + alignedOffset : nullptr;
+
+            return true;
+        }
+
+        return false;
+    }
+
+    void insertFreeRange(uint32_t blockIndex, VkDeviceSize offset, VkDeviceSize size)
+    {
+        Block& block = blocks[blockIndex];
+        block.freeRanges[offset] = freeLists[block.memoryTypeIndex].insert(make_pair(size, make_pair(blockIndex, offset)));
+    }
+
+    void eraseFreeRange(uint32_t blockIndex, map<VkDeviceSize, FreeList::iterator>::iterator range)
     {
+        Block& block = blocks[blockIndex];
+        freeLists[block.memoryTypeIndex].erase(range->second);
+        block.freeRanges.erase(range);
+    }
+
+    // 予算を超える場合、またはドライバがメモリ不足を返した場合はfalse
+    bool createBlock(uint32_t memoryTypeIndex, VkDeviceSize size)
+    {
+        if (liveBlockCount >= maxAllocationCount)
+        {
+            throw runtime_error("exceeded maxMemoryAllocationCount!");
+        }
+
+        // vkAllocateMemoryが失敗する前に、予算を超える確保は行わない
+        uint32_t heapIndex = memProperties.memoryTypes[memoryTypeIndex].heapIndex;
+        updateBudgets();
+        if (heapBudgets[heapIndex].usage + size > heapBudgets[heapIndex].budget)
+        {
+            return false;
+        }
+
+        VkMemoryAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = size;
+        allocInfo.memoryTypeIndex = memoryTypeIndex;
+
+        Block block;
+        block.size = size;
+        block.memoryTypeIndex = memoryTypeIndex;
+
+        VkResult result = vkAllocateMemory(device, &allocInfo, nullptr, &block.memory);
+        if (result == VK_ERROR_OUT_OF_DEVICE_MEMORY || result == VK_ERROR_OUT_OF_HOST_MEMORY)
+        {
+            return false;
+        }
+        if (result != VK_SUCCESS)
+        {
+            throw runtime_error("failed to allocate memory block!");
+        }
+
+        // 同じVkDeviceMemoryを複数回マップすることはできないため、HOST_VISIBLEのブロックは確保時に全体を永続マップしておく
+        if (memProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+        {
+            if (vkMapMemory(device, block.memory, 0, VK_WHOLE_SIZE, 0, &block.mappedData) != VK_SUCCESS)
+            {
+                vkFreeMemory(device, block.memory, nullptr);
+                throw runtime_error("failed to map memory block!");
+            }
+        }
+
+        heapReservedBytes[heapIndex] += size;
+
+        // 解放済みのスロットがあれば再利用
+        uint32_t blockIndex = static_cast<uint32_t>(blocks.size());
+        if (!freeBlockIndices.empty())
+        {
+            blockIndex = freeBlockIndices.back();
+            freeBlockIndices.pop_back();
+            blocks[blockIndex] = block;
+        }
+        else
+        {
+            blocks.push_back(block);
+        }
+
+        blockCounts[memoryTypeIndex]++;
+        liveBlockCount++;
+
+        insertFreeRange(blockIndex, 0, size);
+
+        updateBudgets();
+
+        return true;
+    }
+
+    void destroyBlock(uint32_t blockIndex)
+    {
+        Block& block = blocks[blockIndex];
+
+        // ブロック内の空き領域をフリーリストから除去
+        auto& freeList = freeLists[block.memoryTypeIndex];
+        for (const auto& range : block.freeRanges)
+        {
+            freeList.erase(range.second);
+        }
+
+        if (block.mappedData)
+            vkUnmapMemory(device, block.memory);
+
+        vkFreeMemory(device, block.memory, nullptr);
+        heapReservedBytes[memProperties.memoryTypes[block.memoryTypeIndex].heapIndex] -= block.size;
+        blockCounts[block.memoryTypeIndex]--;
+        liveBlockCount--;
+
+        block = Block{};
+        freeBlockIndices.push_back(blockIndex);
+    }
+};
+
+// 1つのメッシュがメッシュバッファ内で占める範囲 vkCmdDrawIndexedの引数にそのまま使う
+struct MeshRange
+{
+    int32_t vertexOffset = 0; // 先頭頂点の位置（頂点単位）
+    uint32_t vertexCount = 0;
+    uint32_t firstIndex = 0;  // 先頭インデックスの位置（indexTypeの領域の先頭からのインデックス単位）
+    uint32_t indexCount = 0;
+    VkIndexType indexType = VK_INDEX_TYPE_UINT16;
+};
+
+// 複数メッシュの頂点とインデックスを1つのバッファにまとめるためのレイアウト
+// バッファの前半に全メッシュの頂点、後半にインデックスをインデックス型ごとの領域（32bit, 16bit, 8bit）に分けて詰めて配置する
+// 各メッシュはMeshRangeで区別するため、バインドは頂点1回とインデックス型ごとに1回で済み、アップロードも1回のコピーになる
+//
+// インデックスはメッシュの頂点数から最小の型を選ぶ（インデックスはvertexOffsetからの相対値のため、バッファ全体の頂点数は関係無い）
+//   256頂点以下: UINT8（VK_EXT_index_type_uint8が有効な場合）  65536頂点以下: UINT16  それ以上: UINT32
+// 65536頂点を超えるメッシュは、16bitで参照できるチャンクに分割した方が帯域が少なければ分割する
+class MeshArena
+{
+public:
+    explicit MeshArena(uint32_t vertexStride) : vertexStride(vertexStride) {}
+
+    void setUint8IndicesEnabled(bool enabled)
+    {
+        uint8IndicesEnabled = enabled;
+    }
+
+    // インデックスはメッシュ内の頂点番号のまま渡す（vertexOffsetで補正される）、トポロジはトライアングルリスト
+    // 戻り値は最初のMeshRangeの番号 分割されたメッシュは連続する複数のMeshRangeになる
+    uint32_t addMesh(const void* vertices, uint32_t vertexCount, const uint32_t* indices, uint32_t indexCount)
+    {
+        uint32_t firstRange = static_cast<uint32_t>(meshes.size());
+        const char* vertexBytes = static_cast<const char*>(vertices);
+
+        if (vertexCount > UINT16_VERTEX_LIMIT && tryAddSplitMesh(vertexBytes, vertexCount, indices, indexCount))
+            return firstRange;
+
+        addRange(vertexBytes, vertexCount, indices, indexCount);
+        return firstRange;
+    }
+
+    const vector<MeshRange>& getMeshes() const
+    {
+        return meshes;
+    }
+
+    uint32_t getVertexCount() const
+    {
+        return static_cast<uint32_t>(vertexData.size() / vertexStride);
+    }
+
+    VkDeviceSize getVertexOffset() const
+    {
+        return 0;
+    }
+
+    // vkCmdBindIndexBufferのoffsetはインデックス型のサイズの倍数である必要がある
+    // 32bit, 16bit, 8bitの順に並べることで、4バイトに揃えた頂点領域の後ろは全て自然に揃う
+    VkDeviceSize getIndexOffset(VkIndexType indexType) const
+    {
+        VkDeviceSize offset = (vertexData.size() + 3) / 4 * 4;
+        if (indexType == VK_INDEX_TYPE_UINT32)
+            return offset;
+
+        offset += indexData32.size() * sizeof(uint32_t);
+        if (indexType == VK_INDEX_TYPE_UINT16)
+            return offset;
+
+        return offset + indexData16.size() * sizeof(uint16_t);
+    }
+
+    VkDeviceSize getSize() const
+    {
+        return getIndexOffset(VK_INDEX_TYPE_UINT8_EXT) + indexData8.size();
+    }
+
+    // 頂点とインデックスを最終的な配置でdstに書き込む（dstはgetSize()バイト以上）
+    void write(void* dst) const
+    {
+        char* bytes = static_cast<char*>(dst);
+        VkDeviceSize offset32 = getIndexOffset(VK_INDEX_TYPE_UINT32);
+
+        memcpy(bytes + getVertexOffset(), vertexData.data(), vertexData.size());
+        memset(bytes + vertexData.size(), 0, static_cast<size_t>(offset32 - vertexData.size()));
+        memcpy(bytes + offset32, indexData32.data(), indexData32.size() * sizeof(uint32_t));
+        memcpy(bytes + getIndexOffset(VK_INDEX_TYPE_UINT16), indexData16.data(), indexData16.size() * sizeof(uint16_t));
+        memcpy(bytes + getIndexOffset(VK_INDEX_TYPE_UINT8_EXT), indexData8.data(), indexData8.size());
+    }
+
+    void printStats() const
+    {
+        uint32_t rangeCounts[3] = {};
+        for (const MeshRange& mesh : meshes)
+        {
+            rangeCounts[mesh.indexType == VK_INDEX_TYPE_UINT32 ? 0 : mesh.indexType == VK_INDEX_TYPE_UINT16 ? 1 : 2]++;
+        }
+
+        cout << "Mesh Arena:" << endl;
+        cout << "\tvertices: " << getVertexCount() << " (" << vertexData.size() << " bytes)" << endl;
+        cout << "\tranges: " << meshes.size() << " (uint32 " << rangeCounts[0] << ", uint16 " << rangeCounts[1] << ", uint8 " << rangeCounts[2]
+             << "), split meshes: " << splitMeshCount << endl;
+        cout << "\tindex bytes: " << getSize() - getIndexOffset(VK_INDEX_TYPE_UINT32) << endl;
+    }
+
+private:
+    static const uint32_t UINT8_VERTEX_LIMIT = 256;
+    static const uint32_t UINT16_VERTEX_LIMIT = 65536;
+
+    uint32_t vertexStride;
+    bool uint8IndicesEnabled = false;
+    vector<char> vertexData;
+    vector<uint32_t> indexData32;
+    vector<uint16_t> indexData16;
+    vector<uint8_t> indexData8;
+    vector<MeshRange> meshes;
+    uint32_t splitMeshCount = 0;
+
+    VkIndexType selectIndexType(uint32_t vertexCount) const
+    {
+        if (uint8IndicesEnabled && vertexCount <= UINT8_VERTEX_LIMIT)
+            return VK_INDEX_TYPE_UINT8_EXT;
+        if (vertexCount <= UINT16_VERTEX_LIMIT)
+            return VK_INDEX_TYPE_UINT16;
+        return VK_INDEX_TYPE_UINT32;
+    }
+
+    void addRange(const char* vertexBytes, uint32_t vertexCount, const uint32_t* indices, uint32_t indexCount)
+    {
+        MeshRange range;
+        range.vertexOffset = static_cast<int32_t>(getVertexCount());
+        range.vertexCount = vertexCount;
+        range.indexCount = indexCount;
+        range.indexType = selectIndexType(vertexCount);
+
+        vertexData.insert(vertexData.end(), vertexBytes, vertexBytes + static_cast<size_t>(vertexCount) * vertexStride);
+
+        // 型に合わせて縮小して格納する（選択した型の範囲に収まることは頂点数から保証される）
+        if (range.indexType == VK_INDEX_TYPE_UINT32)
+        {
+            range.firstIndex = static_cast<uint32_t>(indexData32.size());
+            indexData32.insert(indexData32.end(), indices, indices + indexCount);
+        }
+        else if (range.indexType == VK_INDEX_TYPE_UINT16)
+        {
+            range.firstIndex = static_cast<uint32_t>(indexData16.size());
+            for (uint32_t i = 0; i < indexCount; i++)
+                indexData16.push_back(static_cast<uint16_t>(indices[i]));
+        }
+        else
+        {
+            range.firstIndex = static_cast<uint32_t>(indexData8.size());
+            for (uint32_t i = 0; i < indexCount; i++)
+                indexData8.push_back(static_cast<uint8_t>(indices[i]));
+        }
+
+        meshes.push_back(range);
+    }
+
+    // 三角形を順に走査し、参照する頂点が65536個に達するまでを1つのチャンクにする
+    // チャンクの境界をまたぐ頂点は複製されるため、インデックスの削減量（2バイト x インデックス数）が複製した頂点のバイト数を上回る場合のみ分割する
+    bool tryAddSplitMesh(const char* vertexBytes, uint32_t vertexCount, const uint32_t* indices, uint32_t indexCount)
+    {
+        struct Chunk
+        {
+            vector<uint32_t> vertices; // 元の頂点番号
+            vector<uint32_t> indices;  // チャンク内の頂点番号
+        };
+
+        vector<Chunk> chunks(1);
+        vector<uint32_t> remap(vertexCount, UINT32_MAX);
+
+        for (uint32_t i = 0; i + 2 < indexCount; i += 3)
+        {
+            uint32_t newVertices = 0;
+            for (uint32_t k = 0; k < 3; k++)
+            {
+                if (remap[indices[i + k]] == UINT32_MAX)
+                    newVertices++;
+            }
+
+            if (chunks.back().vertices.size() + newVertices > UINT16_VERTEX_LIMIT)
+            {
+                for (uint32_t vertex : chunks.back().vertices)
+                    remap[vertex] = UINT32_MAX;
+                chunks.emplace_back();
+            }
+
+            Chunk& chunk = chunks.back();
+            for (uint32_t k = 0; k < 3; k++)
+            {
+                uint32_t vertex = indices[i + k];
+                if (remap[vertex] == UINT32_MAX)
+                {
+                    remap[vertex] = static_cast<uint32_t>(chunk.vertices.size());
+                    chunk.vertices.push_back(vertex);
+                }
+                chunk.indices.push_back(remap[vertex]);
+            }
+        }
+
+        size_t chunkVertexCount = 0;
+        for (const Chunk& chunk : chunks)
+            chunkVertexCount += chunk.vertices.size();
+
+        size_t duplicatedBytes = chunkVertexCount > vertexCount ? (chunkVertexCount - vertexCount) * vertexStride : 0;
+        size_t savedBytes = static_cast<size_t>(indexCount) * (sizeof(uint32_t) - sizeof(uint16_t));
+        if (savedBytes <= duplicatedBytes)
+            return false;
+
+        vector<char> chunkVertexBytes;
+        for (const Chunk& chunk : chunks)
+        {
+            chunkVertexBytes.resize(chunk.vertices.size() * vertexStride);
+            for (size_t v = 0; v < chunk.vertices.size(); v++)
+            {
+                memcpy(chunkVertexBytes.data() + v * vertexStride, vertexBytes + static_cast<size_t>(chunk.vertices[v]) * vertexStride, vertexStride);
+            }
+
+            addRange(chunkVertexBytes.data(), static_cast<uint32_t>(chunk.vertices.size()), chunk.indices.data(), static_cast<uint32_t>(chunk.indices.size()));
+        }
+
+        splitMeshCount++;
+        return true;
+    }
+};
+
+// ACMR: 三角形あたりの頂点シェーダ実行回数（0.5〜3.0 小さいほど良い）
+// ATVR: 参照される頂点あたりの頂点シェーダ実行回数（1.0が理想）
+struct VertexCacheStats
+{
+    float acmr = 0.0f;
+    float atvr = 0.0f;
+};
+
+// ロード時に行うインデックス・頂点の並べ替え アップロード前に適用し、描画結果は変えずにGPUの処理量を減らす
+//   optimizeVertexCache: 頂点変換後キャッシュのヒット率が上がるように三角形を並べ替える（Forsyth）
+//   optimizeOverdraw:    キャッシュ効率を保てる範囲でクラスタに分け、外側を向いたクラスタから描く（オーバードロー削減）
+//   optimizeVertexFetch: 頂点を初めて参照される順に並べ替え、頂点フェッチのメモリアクセスを連続させる
+class MeshOptimizer
+{
+public:
+    // 頂点変換後キャッシュをFIFOとしてシミュレートする 実際のGPUのキャッシュは実装依存のため目安として使う
+    static VertexCacheStats analyzeVertexCache(const vector<uint32_t>& indices, uint32_t vertexCount, uint32_t cacheSize = ANALYZE_CACHE_SIZE)
+    {
+        VertexCacheStats stats;
+        if (indices.empty())
+            return stats;
+
+        // timestampsには頂点がキャッシュに入った時刻を記録する 以降の挿入がcacheSize回未満ならまだキャッシュにある
+        vector<uint32_t> timestamps(vertexCount, 0);
+        uint32_t time = cacheSize + 1;
+        uint32_t misses = 0;
+        uint32_t uniqueVertices = 0;
+
+        for (uint32_t index : indices)
+        {
+            if (timestamps[index] == 0)
+                uniqueVertices++;
+
+            if (time - timestamps[index] > cacheSize)
+            {
+                timestamps[index] = time++;
+                misses++;
+            }
+        }
+
+        stats.acmr = static_cast<float>(misses) / static_cast<float>(indices.size() / 3);
+        stats.atvr = static_cast<float>(misses) / static_cast<float>(uniqueVertices);
+        return stats;
+    }
+
+    // Tom Forsyth "Linear-Speed Vertex Cache Optimisation"
+    // 頂点ごとにキャッシュ内の位置と未描画の三角形数からスコアを付け、キャッシュ内の頂点を使う三角形のうちスコア最大のものを貪欲に選ぶ
+    static void optimizeVertexCache(vector<uint32_t>& indices, uint32_t vertexCount)
+    {
+        size_t triangleCount = indices.size() / 3;
+        if (triangleCount == 0)
+            return;
+
+        // 頂点ごとの隣接三角形リスト 描画済みの三角形はリストの末尾に移し、先頭remaining[v]個を未描画として扱う
+        vector<uint32_t> remaining(vertexCount, 0);
+        for (size_t i = 0; i < triangleCount * 3; i++)
+            remaining[indices[i]]++;
+
+        vector<uint32_t> adjacencyOffsets(vertexCount + 1, 0);
+        for (uint32_t v = 0; v < vertexCount; v++)
+            adjacencyOffsets[v + 1] = adjacencyOffsets[v] + remaining[v];
+
+        vector<uint32_t> adjacency(triangleCount * 3);
+        vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+        for (size_t t = 0; t < triangleCount; t++)
+        {
+            for (uint32_t k = 0; k < 3; k++)
+                adjacency[fill[indices[t * 3 + k]]++] = static_cast<uint32_t>(t);
+        }
+
+        vector<float> vertexScores(vertexCount);
+        for (uint32_t v = 0; v < vertexCount; v++)
+            vertexScores[v] = getVertexScore(-1, remaining[v]);
+
+        vector<bool> emitted(triangleCount, false);
+        vector<uint32_t> output;
+        output.reserve(triangleCount * 3);
+
+        vector<uint32_t> cache;
+        vector<uint32_t> newCache;
+        size_t inputCursor = 0;
+        int64_t best = -1;
+
+        while (output.size() < triangleCount * 3)
+        {
+            // キャッシュ内の頂点を使う三角形が無ければ（行き止まり）、入力順で次の未描画の三角形から再開する
+            if (best < 0)
+            {
+                while (emitted[inputCursor])
+                    inputCursor++;
+                best = static_cast<int64_t>(inputCursor);
+            }
+
+            size_t triangle = static_cast<size_t>(best);
+            const uint32_t* triangleVertices = &indices[triangle * 3];
+            emitted[triangle] = true;
+            output.insert(output.end(), triangleVertices, triangleVertices + 3);
+
+            for (uint32_t k = 0; k < 3; k++)
+            {
+                uint32_t v = triangleVertices[k];
+                uint32_t* list = &adjacency[adjacencyOffsets[v]];
+                for (uint32_t i = 0; i < remaining[v]; i++)
+                {
+                    if (list[i] == triangle)
+                    {
+                        swap(list[i], list[remaining[v] - 1]);
+                        break;
+                    }
+                }
+                remaining[v]--;
+            }
+
+            // 描画した三角形の頂点をキャッシュの先頭に入れ、はみ出した頂点は追い出す
+            newCache.assign(triangleVertices, triangleVertices + 3);
+            for (uint32_t v : cache)
+            {
+                if (v != triangleVertices[0] && v != triangleVertices[1] && v != triangleVertices[2])
+                    newCache.push_back(v);
+            }
+
+            for (size_t i = FORSYTH_CACHE_SIZE; i < newCache.size(); i++)
+            {
+                vertexScores[newCache[i]] = getVertexScore(-1, remaining[newCache[i]]);
+            }
+            newCache.resize(std::min(newCache.size(), static_cast<size_t>(FORSYTH_CACHE_SIZE)));
+            cache.swap(newCache);
+
+            for (size_t i = 0; i < cache.size(); i++)
+            {
+                vertexScores[cache[i]] = getVertexScore(static_cast<int>(i), remaining[cache[i]]);
+            }
+
+            // 次の候補はキャッシュ内の頂点を使う未描画の三角形に限る
+            best = -1;
+            float bestScore = -1.0f;
+            for (uint32_t v : cache)
+            {
+                const uint32_t* list = &adjacency[adjacencyOffsets[v]];
+                for (uint32_t i = 0; i < remaining[v]; i++)
+                {
+                    const uint32_t* candidate = &indices[list[i] * 3];
+                    float score = vertexScores[candidate[0]] + vertexScores[candidate[1]] + vertexScores[candidate[2]];
+                    if (score > bestScore)
+                    {
+                        bestScore = score;
+                        best = list[i];
+                    }
+                }
+            }
+        }
+
+        indices.swap(output);
+    }
+
+    // Sander et al. "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw"の簡略版
+    // optimizeVertexCacheの後に呼ぶ ACMRがメッシュ全体のthreshold倍以下に収まる位置でのみクラスタを区切り、
+    // クラスタの向き（面積で重み付けした法線）とメッシュ中心からの方向の内積が大きい順、つまり外側を向いたクラスタから描く
+    // 閉じた3Dメッシュを前提とする 奥行き（z）の幅が無い平面のメッシュでは並べ替えの基準が意味を持たないため何もしない
+    // 並べ替えた場合はtrueを返す
+    static bool optimizeOverdraw(vector<uint32_t>& indices, const vector<vec3>& positions, float threshold)
+    {
+        size_t triangleCount = indices.size() / 3;
+        if (triangleCount == 0 || !hasDepthExtent(positions))
+            return false;
+
+        uint32_t vertexCount = static_cast<uint32_t>(positions.size());
+        float meshAcmr = analyzeVertexCache(indices, vertexCount).acmr;
+
+        // キャッシュが空になる（3頂点ともミスする）三角形はクラスタの先頭にしても追加のミスが出ない
+        vector<size_t> clusterStarts = { 0 };
+        vector<uint32_t> timestamps(vertexCount, 0);
+        uint32_t time = ANALYZE_CACHE_SIZE + 1;
+        uint32_t clusterMisses = 0;
+
+        for (size_t t = 0; t < triangleCount; t++)
+        {
+            uint32_t misses = 0;
+            for (uint32_t k = 0; k < 3; k++)
+            {
+                uint32_t v = indices[t * 3 + k];
+                if (time - timestamps[v] > ANALYZE_CACHE_SIZE)
+                {
+                    timestamps[v] = time++;
+                    misses++;
+                }
+            }
+
+            size_t clusterTriangles = t - clusterStarts.back();
+            if (misses == 3 && clusterTriangles > 0 &&
+                static_cast<float>(clusterMisses) / static_cast<float>(clusterTriangles) <= meshAcmr * threshold)
+            {
+                clusterStarts.push_back(t);
+                clusterMisses = 0;
+            }
+
+            clusterMisses += misses;
+        }
+        clusterStarts.push_back(triangleCount);
+
+        vec3 meshCentroid(0.0f);
+        for (const vec3& position : positions)
+            meshCentroid += position;
+        meshCentroid /= static_cast<float>(std::max<size_t>(positions.size(), 1));
+
+        struct Cluster
+        {
+            size_t firstTriangle;
+            size_t triangleCount;
+            float sortKey;
+        };
+
+        vector<Cluster> clusters;
+        for (size_t c = 0; c + 1 < clusterStarts.size(); c++)
+        {
+            vec3 centroid(0.0f);
+            vec3 normal(0.0f);
+            float area = 0.0f;
+
+            for (size_t t = clusterStarts[c]; t < clusterStarts[c + 1]; t++)
+            {
+                const vec3& p0 = positions[indices[t * 3 + 0]];
+                const vec3& p1 = positions[indices[t * 3 + 1]];
+                const vec3& p2 = positions[indices[t * 3 + 2]];
+
+                vec3 areaNormal = cross(p1 - p0, p2 - p0); // 長さは三角形の面積の2倍
+                float triangleArea = length(areaNormal);
+
+                centroid += (p0 + p1 + p2) * (triangleArea / 3.0f);
+                normal += areaNormal;
+                area += triangleArea;
+            }
+
+            centroid = area > 0.0f ? centroid / area : meshCentroid;
+            float normalLength = length(normal);
+            normal = normalLength > 0.0f ? normal / normalLength : vec3(0.0f);
+
+            clusters.push_back({ clusterStarts[c], clusterStarts[c + 1] - clusterStarts[c], dot(centroid - meshCentroid, normal) });
+        }
+
+        // 向きが同じクラスタ同士はキャッシュ最適化の順序を保つ
+        stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) { return a.sortKey > b.sortKey; });
+
+        vector<uint32_t> output;
+        output.reserve(indices.size());
+        for (const Cluster& cluster : clusters)
+        {
+            output.insert(output.end(), indices.begin() + cluster.firstTriangle * 3, indices.begin() + (cluster.firstTriangle + cluster.triangleCount) * 3);
+        }
+
+        indices.swap(output);
+        return true;
+    }
+
+    static bool hasDepthExtent(const vector<vec3>& positions)
+    {
+        if (positions.empty())
+            return false;
+
+        auto range = minmax_element(positions.begin(), positions.end(), [](const vec3& a, const vec3& b) { return a.z < b.z; });
+        return range.second->z > range.first->z;
+    }
+
+    // 三角形の順序を決めた後に呼ぶ 参照されない頂点は取り除かれ、戻り値は新しい頂点数
+    template<typename VertexType>
+    static uint32_t optimizeVertexFetch(vector<VertexType>& vertices, vector<uint32_t>& indices)
+    {
+        vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+        vector<VertexType> output;
+        output.reserve(vertices.size());
+
+        for (uint32_t& index : indices)
+        {
+            if (remap[index] == UINT32_MAX)
+            {
+                remap[index] = static_cast<uint32_t>(output.size());
+                output.push_back(vertices[index]);
+            }
+            index = remap[index];
+        }
+
+        vertices.swap(output);
+        return static_cast<uint32_t>(vertices.size());
+    }
+
+private:
+    static const uint32_t ANALYZE_CACHE_SIZE = 16; // ACMR/ATVRの計測に使うFIFOキャッシュのサイズ
+    static const uint32_t FORSYTH_CACHE_SIZE = 32; // Forsythのスコア計算で想定するLRUキャッシュのサイズ
+
+    static float getVertexScore(int cachePosition, uint32_t remainingTriangles)
+    {
+        // 残りの三角形が無い頂点を使う三角形は既に描画済み
+        if (remainingTriangles == 0)
+            return -1.0f;
+
+        float score = 0.0f;
+        if (cachePosition >= 0)
+        {
+            // 直前の三角形の3頂点は、次の三角形がその辺を共有しやすいように一律のスコアにする
+            if (cachePosition < 3)
+                score = 0.75f;
+            else
+                score = pow(1.0f - static_cast<float>(cachePosition - 3) / static_cast<float>(FORSYTH_CACHE_SIZE - 3), 1.5f);
+        }
+
+        // 残りの三角形が少ない頂点を優先し、孤立した三角形を残さないようにする
+        score += 2.0f * pow(static_cast<float>(remainingTriangles), -0.5f);
+        return score;
+    }
+};
+
+// 同じメッシュ・同じパイプラインのオブジェクトを1回のインスタンス描画にまとめる
+// オブジェクトを(pipeline, mesh)の順に並べ替え、各バッチのインスタンスがインスタンスバッファ内で連続するようにする
+class InstanceBatcher
+{
+public:
+    // 戻り値はバッチ構成（バッチの数・メッシュ・インスタンス範囲）が前回から変わったか
+    // 変わっていなければ、事前記録したコマンドバッファはそのまま使える（インスタンスの中身はバッファの更新だけで反映される）
+    bool build(const vector<SceneObject>& objects)
+    {
+        objectOrder.resize(objects.size());
+        for (uint32_t i = 0; i < objects.size(); i++)
+            objectOrder[i] = i;
+
+        stable_sort(objectOrder.begin(), objectOrder.end(), [&objects](uint32_t a, uint32_t b)
+        {
+            if (objects[a].pipeline != objects[b].pipeline)
+                return objects[a].pipeline < objects[b].pipeline;
+            return objects[a].mesh < objects[b].mesh;
+        });
+
+        vector<DrawBatch> newBatches;
+        for (uint32_t i = 0; i < objectOrder.size(); i++)
+        {
+            const SceneObject& object = objects[objectOrder[i]];
+            if (newBatches.empty() || newBatches.back().pipeline != object.pipeline || newBatches.back().mesh != object.mesh)
+            {
+                DrawBatch batch;
+                batch.mesh = object.mesh;
+                batch.pipeline = object.pipeline;
+                batch.firstInstance = i;
+                newBatches.push_back(batch);
+            }
+            newBatches.back().instanceCount++;
+        }
+
+        bool changed = newBatches.size() != batches.size();
+        for (size_t i = 0; i < newBatches.size() && !changed; i++)
+        {
+            changed = newBatches[i].mesh != batches[i].mesh || newBatches[i].pipeline != batches[i].pipeline ||
+                      newBatches[i].firstInstance != batches[i].firstInstance || newBatches[i].instanceCount != batches[i].instanceCount;
+        }
+
+        batches.swap(newBatches);
+        return changed;
+    }
+
+    const vector<DrawBatch>& getBatches() const
+    {
+        return batches;
+    }
+
+    // インスタンスバッファのi番目に書き込むオブジェクトの番号
+    const vector<uint32_t>& getObjectOrder() const
+    {
+        return objectOrder;
+    }
+
+private:
+    vector<DrawBatch> batches;
+    vector<uint32_t> objectOrder;
+};
+
+// StagingRingから切り出した領域
+struct StagingRegion
+{
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    void* data = nullptr; // CPUの書き込み先（永続マップ済み）
+};
+
+// 永続マップされた1つのステージングバッファをリングとして使い回す
+// アップロードのたびにバッファを作成・マップ・破棄せず、書き込み位置(head)を進めるだけで領域を確保する
+// 確保した領域は提出単位（パーティション）ごとにフェンス値を付け、GPUの完了後にまとめて回収(tailを進める)する
+class StagingRing
+{
+public:
+    void init(VkBuffer buffer, void* mappedData, VkDeviceSize capacity, VkDeviceSize alignment)
+    {
+        this->buffer = buffer;
+        this->mappedData = static_cast<char*>(mappedData);
+        this->capacity = capacity;
+        this->alignment = std::max<VkDeviceSize>(alignment, 1);
+        head = 0;
+        tail = 0;
+        openBytes = 0;
+        partitions.clear();
+    }
+
+    // 空きが足りない場合はfalseを返す。呼び出し側はGPUの完了を待ってretireした後に再試行する
+    bool allocate(VkDeviceSize size, StagingRegion& region)
+    {
+        if (size > capacity)
+            return false;
+
+        VkDeviceSize offset = (head + alignment - 1) / alignment * alignment;
+
+        if (head >= tail)
+        {
+            // [tail, head)が使用中。末尾に収まらなければ先頭に折り返す
+            if (offset + size > capacity)
+            {
+                // head == tailと区別できなくなるため、tailちょうどまでは使わない
+                if (size >= tail)
+                    return false;
+                offset = 0;
+            }
+        }
+        else
+        {
+            // 折り返し済み。[head, tail)のみ空き
+            if (offset + size >= tail)
+                return false;
+        }
+
+        head = offset + size;
+        openBytes += size;
+
+        region.buffer = buffer;
+        region.offset = offset;
+        region.size = size;
+        region.data = mappedData + offset;
+
+        return true;
+    }
+
+    // 前回のclose以降に確保した領域を1つのパーティションとして閉じ、それを読むGPU提出のフェンス値を関連付ける
+    void close(uint64_t fenceValue)
+    {
+        if (openBytes == 0)
+            return;
+
+        partitions.push_back({ head, fenceValue });
+        openBytes = 0;
+    }
+
+    // completedValue以下のフェンス値を持つパーティションを回収
+    void retire(uint64_t completedValue)
+    {
+        while (!partitions.empty() && partitions.front().fenceValue <= completedValue)
+        {
+            tail = partitions.front().end;
+            partitions.pop_front();
+        }
+
+        // 全て回収済みなら先頭から使い直し、折り返しによる無駄を減らす
+        if (partitions.empty() && openBytes == 0)
+        {
+            head = 0;
+            tail = 0;
+        }
+    }
+
+    bool hasPending() const
+    {
+        return !partitions.empty();
+    }
+
+    uint64_t getOldestPendingValue() const
+    {
+        return partitions.empty() ? 0 : partitions.front().fenceValue;
+    }
+
+    VkDeviceSize getCapacity() const
+    {
+        return capacity;
+    }
+
+private:
+    struct Partition
+    {
+        VkDeviceSize end;    // パーティション末尾（回収時の新しいtail）
+        uint64_t fenceValue; // この値の提出が完了すれば再利用可能
+    };
+
+    VkBuffer buffer = VK_NULL_HANDLE;
+    char* mappedData = nullptr;
+    VkDeviceSize capacity = 0;
+    VkDeviceSize alignment = 1;
+    VkDeviceSize head = 0;
+    VkDeviceSize tail = 0;
+    VkDeviceSize openBytes = 0; // まだcloseしていない確保済みバイト数
+    deque<Partition> partitions;
+};
+
+// アップロード完了を待つためのチケット。値はUploadQueueの提出ごとに単調増加する
+struct UploadTicket
+{
+    uint64_t value = 0;
+};
+
+// 複数のコピーを1つのコマンドバッファにまとめて記録し、フェンス付きで提出する
+// 提出のたびにvkQueueWaitIdleでCPUとGPUを止めず、リソースを初めて使う時点でのみチケットを待つ
+//
+// 転送専用キュー族がある場合はそちらでコピーし、描画と並行して実行させる
+// EXCLUSIVEのバッファはキュー族ごとに所有権を持つため、転送キューでrelease、グラフィックスキューでacquireのバリアが必要
+class UploadQueue
+{
+public:
+    void init(VkDevice device, VkQueue transferQueue, uint32_t transferFamily, VkQueue graphicsQueue, uint32_t graphicsFamily)
+    {
+        this->device = device;
+        this->transferQueue = transferQueue;
+        this->graphicsQueue = graphicsQueue;
+        this->transferFamily = transferFamily;
+        this->graphicsFamily = graphicsFamily;
+
+        transferCommandPool = createCommandPool(transferFamily);
+
+        // キュー族が異なる場合のみ、所有権acquire用のコマンドをグラフィックスキュー族のプールから確保する
+        if (needsOwnershipTransfer())
+        {
+            acquireCommandPool = createCommandPool(graphicsFamily);
+        }
+    }
+
+    // staging bufferからvertex bufferへのコピーはGPU内部で行われるため、vkCmdCopyBufferコマンドをキューに登録する必要がある
+    // 現在記録中のバッチにコピーを追加し、そのバッチのチケットを返す（提出はflushまで遅延）
+    UploadTicket copyBuffer(VkBuffer srcBuffer, VkDeviceSize srcOffset, VkBuffer dstBuffer, VkDeviceSize dstOffset, VkDeviceSize size)
+    {
+        beginBatch();
+
+        VkBufferCopy copyRegion{};
+        copyRegion.srcOffset = srcOffset;
+        copyRegion.dstOffset = dstOffset;
+        copyRegion.size = size;
+        vkCmdCopyBuffer(recording.transferCommandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+
+        if (needsOwnershipTransfer())
+        {
+            // releaseとacquireは同じ範囲・同じキュー族の組で記録する必要がある
+            VkBufferMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+            barrier.srcQueueFamilyIndex = transferFamily;
+            barrier.dstQueueFamilyIndex = graphicsFamily;
+            barrier.buffer = dstBuffer;
+            barrier.offset = dstOffset;
+            barrier.size = size;
+            recording.ownershipBarriers.push_back(barrier);
+        }
+
+        return { recording.value };
+    }
+
+    // 記録中のバッチを提出する。記録中でなければ最後に提出したチケットを返す
+    UploadTicket flush()
+    {
+        if (!isRecording)
+            return { submittedValue };
+
+        if (needsOwnershipTransfer())
+        {
+            submitWithOwnershipTransfer();
+        }
+        else
+        {
+            // 同一キューの後続の提出（描画）で頂点・インデックス・間接描画コマンドとして読む前に、転送の書き込みを可視にする
+            VkMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+            vkCmdPipelineBarrier(recording.transferCommandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0,
+                                 1, &barrier, 0, nullptr, 0, nullptr);
+
+            vkEndCommandBuffer(recording.transferCommandBuffer);
+
+            VkSubmitInfo submitInfo{};
+            submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+            submitInfo.commandBufferCount = 1;
+            submitInfo.pCommandBuffers = &recording.transferCommandBuffer;
+
+            // vkCmdCopyBufferにはVK_QUEUE_TRANSFER_BITが必要だが、VK_QUEUE_GRAPHICS_BITはVK_QUEUE_TRANSFER_BITを含む
+            if (vkQueueSubmit(transferQueue, 1, &submitInfo, recording.fence) != VK_SUCCESS)
+            {
+                throw runtime_error("failed to submit upload command buffer!");
+            }
+        }
+
+        submittedValue = recording.value;
+        inFlight.push_back(recording);
+        isRecording = false;
+
+        return { submittedValue };
+    }
+
+    // 完了済みのバッチを回収し、完了済みの最大チケット値を返す（ブロックしない）
+    uint64_t getCompletedValue()
+    {
+        while (!inFlight.empty() && vkGetFenceStatus(device, inFlight.front().fence) == VK_SUCCESS)
+        {
+            retireFront();
+        }
+
+        return completedValue;
+    }
+
+    bool isComplete(UploadTicket ticket)
+    {
+        return ticket.value <= getCompletedValue();
+    }
+
+    // チケットのバッチが完了するまで待機。未提出なら先に提出する
+    void wait(UploadTicket ticket)
+    {
+        if (isComplete(ticket))
+            return;
+
+        if (isRecording && ticket.value >= recording.value)
+            flush();
+
+        while (!inFlight.empty() && inFlight.front().value <= ticket.value)
+        {
+            vkWaitForFences(device, 1, &inFlight.front().fence, VK_TRUE, UINT64_MAX);
+            retireFront();
+        }
+    }
+
+    bool needsOwnershipTransfer() const
+    {
+        return transferFamily != graphicsFamily;
+    }
+
+    void destroy()
+    {
+        flush();
+        wait({ submittedValue });
+
+        for (auto& batch : freeBatches)
+        {
+            vkDestroyFence(device, batch.fence, nullptr);
+            if (batch.semaphore != VK_NULL_HANDLE)
+                vkDestroySemaphore(device, batch.semaphore, nullptr);
+        }
+        freeBatches.clear();
+
+        // コマンドバッファはプールと一緒に解放される
+        vkDestroyCommandPool(device, transferCommandPool, nullptr);
+        if (acquireCommandPool != VK_NULL_HANDLE)
+            vkDestroyCommandPool(device, acquireCommandPool, nullptr);
+    }
+
+private:
+    struct Batch
+    {
+        VkCommandBuffer transferCommandBuffer = VK_NULL_HANDLE;
+        VkCommandBuffer acquireCommandBuffer = VK_NULL_HANDLE; // キュー族が異なる場合のみ使用
+        VkSemaphore semaphore = VK_NULL_HANDLE;                // 転送完了 -> acquire
+        VkFence fence = VK_NULL_HANDLE;                        // バッチ全体（acquireを含む）の完了
+        uint64_t value = 0;
+        vector<VkBufferMemoryBarrier> ownershipBarriers;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    VkQueue transferQueue = VK_NULL_HANDLE;
+    VkQueue graphicsQueue = VK_NULL_HANDLE;
+    uint32_t transferFamily = 0;
+    uint32_t graphicsFamily = 0;
+    VkCommandPool transferCommandPool = VK_NULL_HANDLE;
+    VkCommandPool acquireCommandPool = VK_NULL_HANDLE;
+
+    Batch recording;
+    bool isRecording = false;
+    deque<Batch> inFlight;     // 提出順（＝値の昇順）
+    vector<Batch> freeBatches; // 完了後に再利用するコマンドバッファとフェンス
+
+    uint64_t nextValue = 1;
+    uint64_t submittedValue = 0;
+    uint64_t completedValue = 0;
+
+    VkCommandPool createCommandPool(uint32_t queueFamilyIndex)
+    {
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        // 短命なコマンドバッファ用（TRANSIENT）で、バッチごとに個別リセットする
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        poolInfo.queueFamilyIndex = queueFamilyIndex;
+
+        VkCommandPool pool;
+        if (vkCreateCommandPool(device, &poolInfo, nullptr, &pool) != VK_SUCCESS)
+        {
+            throw runtime_error("failed to create upload command pool!");
+        }
+
+        return pool;
+    }
+
+    VkCommandBuffer allocateCommandBuffer(VkCommandPool pool)
+    {
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandPool = pool;
+        allocInfo.commandBufferCount = 1;
+
+        VkCommandBuffer commandBuffer;
+        if (vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer) != VK_SUCCESS)
+        {
+            throw runtime_error("failed to allocate upload command buffer!");
+        }
+
+        return commandBuffer;
+    }
+
+    void beginBatch()
+    {
+        if (isRecording)
+            return;
+
+        if (!freeBatches.empty())
+        {
+            recording = freeBatches.back();
+            freeBatches.pop_back();
+
+            vkResetFences(device, 1, &recording.fence);
+            vkResetCommandBuffer(recording.transferCommandBuffer, 0);
+            if (recording.acquireCommandBuffer != VK_NULL_HANDLE)
+                vkResetCommandBuffer(recording.acquireCommandBuffer, 0);
+            recording.ownershipBarriers.clear();
+        }
+        else
+        {
+            recording = Batch{};
+            recording.transferCommandBuffer = allocateCommandBuffer(transferCommandPool);
+
+            VkFenceCreateInfo fenceInfo{};
+            fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+            if (vkCreateFence(device, &fenceInfo, nullptr, &recording.fence) != VK_SUCCESS)
+            {
+                throw runtime_error("failed to create upload fence!");
+            }
+
+            if (needsOwnershipTransfer())
+            {
+                recording.acquireCommandBuffer = allocateCommandBuffer(acquireCommandPool);
+
+                VkSemaphoreCreateInfo semaphoreInfo{};
+                semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+                if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &recording.semaphore) != VK_SUCCESS)
+                {
+                    throw runtime_error("failed to create upload semaphore!");
+                }
+            }
+        }
+
+        recording.value = nextValue++;
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        // 各バッチは1回の提出ごとに記録し直す
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+        vkBeginCommandBuffer(recording.transferCommandBuffer, &beginInfo);
+        isRecording = true;
+    }
+
+    // 転送キュー: コピー -> release  グラフィックスキュー: (セマフォ待ち) -> acquire
+    void submitWithOwnershipTransfer()
+    {
+        // release: 転送キュー側では書き込みを可視化するだけで、dstAccessMaskは無視される
+        vector<VkBufferMemoryBarrier> releaseBarriers = recording.ownershipBarriers;
+        for (auto& barrier : releaseBarriers)
+        {
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = 0;
+        }
+
+        vkCmdPipelineBarrier(recording.transferCommandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+                             0, nullptr, static_cast<uint32_t>(releaseBarriers.size()), releaseBarriers.data(), 0, nullptr);
+
+        vkEndCommandBuffer(recording.transferCommandBuffer);
+
+        VkSubmitInfo transferSubmit{};
+        transferSubmit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        transferSubmit.commandBufferCount = 1;
+        transferSubmit.pCommandBuffers = &recording.transferCommandBuffer;
+        transferSubmit.signalSemaphoreCount = 1;
+        transferSubmit.pSignalSemaphores = &recording.semaphore;
+
+        if (vkQueueSubmit(transferQueue, 1, &transferSubmit, VK_NULL_HANDLE) != VK_SUCCESS)
+        {
+            throw runtime_error("failed to submit upload command buffer!");
+        }
+
+        // acquire: グラフィックスキュー側では srcAccessMaskは無視され、間接描画・頂点入力からの読み取りを可視化する
+        vector<VkBufferMemoryBarrier> acquireBarriers = recording.ownershipBarriers;
+        for (auto& barrier : acquireBarriers)
+        {
+            barrier.srcAccessMask = 0;
+            barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+        }
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+        vkBeginCommandBuffer(recording.acquireCommandBuffer, &beginInfo);
+        // セマフォ待ちのステージとsrcStageMaskを一致させ、転送完了 -> acquireの依存関係を繋げる
+        vkCmdPipelineBarrier(recording.acquireCommandBuffer, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                             VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0,
+                             0, nullptr, static_cast<uint32_t>(acquireBarriers.size()), acquireBarriers.data(), 0, nullptr);
+        vkEndCommandBuffer(recording.acquireCommandBuffer);
+
+        VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+
+        VkSubmitInfo acquireSubmit{};
+        acquireSubmit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        acquireSubmit.waitSemaphoreCount = 1;
+        acquireSubmit.pWaitSemaphores = &recording.semaphore;
+        acquireSubmit.pWaitDstStageMask = &waitStage;
+        acquireSubmit.commandBufferCount = 1;
+        acquireSubmit.pCommandBuffers = &recording.acquireCommandBuffer;
+
+        // フェンスはacquire側に付け、チケット完了 = グラフィックスキューで使用可能 とする
+        if (vkQueueSubmit(graphicsQueue, 1, &acquireSubmit, recording.fence) != VK_SUCCESS)
+        {
+            throw runtime_error("failed to submit ownership acquire command buffer!");
+        }
+    }
+
+    void retireFront()
+    {
+        completedValue = inFlight.front().value;
+        freeBatches.push_back(inFlight.front());
+        inFlight.pop_front();
+    }
+};
+
+// ワーカースレッドでジョブを並列実行するスレッドプール
+// ジョブには実行中のワーカー番号を渡し、スレッドごとのリソース（コマンドプールなど）の選択に使えるようにする
+class WorkerPool
+{
+public:
+    void init(uint32_t threadCount)
+    {
+        stopping = false;
+        for (uint32_t i = 0; i < threadCount; i++)
+        {
+            threads.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    template <typename F>
+    auto submit(F&& job) -> future<decltype(job(0u))>
+    {
+        using Result = decltype(job(0u));
+
+        auto task = make_shared<packaged_task<Result(uint32_t)>>(std::forward<F>(job));
+        future<Result> result = task->get_future();
+        {
+            lock_guard<mutex> lock(queueMutex);
+            jobs.push_back([task](uint32_t workerIndex) { (*task)(workerIndex); });
+        }
+        condition.notify_one();
+
+        return result;
+    }
+
+    uint32_t getThreadCount() const
+    {
+        return static_cast<uint32_t>(threads.size());
+    }
+
+    // 残っているジョブを全て実行してからスレッドを終了する
+    void destroy()
+    {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            stopping = true;
+        }
+        condition.notify_all();
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        threads.clear();
+    }
+
+private:
+    vector<thread> threads;
+    deque<function<void(uint32_t)>> jobs;
+    mutex queueMutex;
+    condition_variable condition;
+    bool stopping = false;
+
+    void workerLoop(uint32_t workerIndex)
+    {
+        while (true)
+        {
+            function<void(uint32_t)> job;
+            {
+                unique_lock<mutex> lock(queueMutex);
+                condition.wait(lock, [this] { return stopping || !jobs.empty(); });
+
+                if (jobs.empty())
+                    return;
+
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+
+            job(workerIndex); // 例外はpackaged_task経由でfutureに渡される
+        }
+    }
+};
+
+// ワーカースレッドでパイプラインを構築するための記述
+// VkGraphicsPipelineCreateInfoはポインタの集合なので、別スレッドに渡すと参照先の寿命が問題になる
+// そのため各ステートを値で保持し、ワーカースレッド側でCreateInfoを組み立てる
+struct GraphicsPipelineDesc
+{
+    VkShaderModule vertShaderModule = VK_NULL_HANDLE;
+    VkShaderModule fragShaderModule = VK_NULL_HANDLE;
+    vector<VkVertexInputBindingDescription> bindingDescriptions;
+    vector<VkVertexInputAttributeDescription> attributeDescriptions;
+    VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    VkPolygonMode polygonMode = VK_POLYGON_MODE_FILL;
+    VkCullModeFlags cullMode = VK_CULL_MODE_BACK_BIT;
+    VkFrontFace frontFace = VK_FRONT_FACE_CLOCKWISE;
+    VkPipelineLayout layout = VK_NULL_HANDLE;
+    VkRenderPass renderPass = VK_NULL_HANDLE;
+    uint32_t subpass = 0;
+};
+
+struct PipelineBuildResult
+{
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    double compileMs = 0.0; // ワーカースレッド上でのvkCreateGraphicsPipelinesの所要時間
+};
+
+// 多数のパイプライン（マテリアルの組み合わせ）をワーカースレッドで並列にコンパイルする
+// VkPipelineCacheは内部で同期されるため、全スレッドで1つのキャッシュを共有できる
+class PipelineBuilder
+{
+public:
+    void init(VkDevice device, VkPipelineCache pipelineCache, WorkerPool* workerPool)
+    {
+        this->device = device;
+        this->pipelineCache = pipelineCache;
+        this->workerPool = workerPool;
+    }
+
+    // 即座に戻り、結果はfutureで受け取る。描画側は完成したパイプラインから順に使う
+    shared_future<PipelineBuildResult> build(const GraphicsPipelineDesc& desc)
+    {
+        return workerPool->submit([this, desc](uint32_t) { return buildGraphicsPipeline(desc); }).share();
+    }
+
+private:
+    VkDevice device = VK_NULL_HANDLE;
+    VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+    WorkerPool* workerPool = nullptr;
+
+    PipelineBuildResult buildGraphicsPipeline(const GraphicsPipelineDesc& desc)
+    {
+        VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
+        vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
+        vertShaderStageInfo.module = desc.vertShaderModule;
+        vertShaderStageInfo.pName = "main"; // 異なるpNameをエントリ関数名として指定することで、1つのコード内で複数のシェーダーを実装可能
+
+        VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
+        fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+        fragShaderStageInfo.module = desc.fragShaderModule;
+        fragShaderStageInfo.pName = "main";
+
+        VkPipelineShaderStageCreateInfo shaderStages[] = { vertShaderStageInfo, fragShaderStageInfo };
+
+        // 頂点の解析設定
+        VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+        vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+        vertexInputInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(desc.bindingDescriptions.size());
+        vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(desc.attributeDescriptions.size()); 
+        vertexInputInfo.pVertexBindingDescriptions = desc.bindingDescriptions.data();
+        vertexInputInfo.pVertexAttributeDescriptions = desc.attributeDescriptions.data();
+
+        // プリミティブのアセンブリ設定
+        VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+        inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+        inputAssembly.topology = desc.topology;
+        inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+        // ビューポート設定
+        VkPipelineViewportStateCreateInfo viewportState{};
+        viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+        viewportState.viewportCount = 1;
+        viewportState.scissorCount = 1;
+
+        // ラスタライズ設定
+        VkPipelineRasterizationStateCreateInfo rasterizer{};
+        rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+        rasterizer.depthClampEnable = VK_FALSE;  // 視錐台外の部分をクリップせずクランプするか
+        rasterizer.rasterizerDiscardEnable = VK_FALSE; // ラスタライザの出力を破棄するか
+        rasterizer.polygonMode = desc.polygonMode;
+        rasterizer.lineWidth = 1.0f;
+        rasterizer.cullMode = desc.cullMode;
+        rasterizer.frontFace = desc.frontFace;
+        rasterizer.depthBiasEnable = VK_FALSE; //  シャドウマッピングのバイアスに関連
+
+        // マルチサンプリング設定
+        VkPipelineMultisampleStateCreateInfo multisampling{};
+        multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+        multisampling.sampleShadingEnable = VK_FALSE;
+        multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+        // ブレンド設定
+        VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+        colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+        colorBlendAttachment.blendEnable = VK_FALSE;
+
+        VkPipelineColorBlendStateCreateInfo colorBlending{};
+        colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+        colorBlending.logicOpEnable = VK_FALSE;  // 有効にするとグローバルブレンド設定になり、フレームバッファごとのブレンド設定が無効化
+        colorBlending.logicOp = VK_LOGIC_OP_COPY;
+        colorBlending.attachmentCount = 1;
+        colorBlending.pAttachments = &colorBlendAttachment;
+        colorBlending.blendConstants[0] = 0.0f;
+        colorBlending.blendConstants[1] = 0.0f;
+        colorBlending.blendConstants[2] = 0.0f;
+        colorBlending.blendConstants[3] = 0.0f;
+
+        // 動的に変更可能な機能の指定
+        vector<VkDynamicState> dynamicStates =
+        {
+            VK_DYNAMIC_STATE_VIEWPORT,
+            VK_DYNAMIC_STATE_SCISSOR
+        };
+        VkPipelineDynamicStateCreateInfo dynamicState{};
+        dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+        dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+        dynamicState.pDynamicStates = dynamicStates.data();
+
+        // pipelineを作成
+        VkGraphicsPipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+        pipelineInfo.stageCount = 2;
+        pipelineInfo.pStages = shaderStages;
+        pipelineInfo.pVertexInputState = &vertexInputInfo;
+        pipelineInfo.pInputAssemblyState = &inputAssembly;
+        pipelineInfo.pViewportState = &viewportState;
+        pipelineInfo.pRasterizationState = &rasterizer;
+        pipelineInfo.pMultisampleState = &multisampling;
+        pipelineInfo.pColorBlendState = &colorBlending;
+        pipelineInfo.pDynamicState = &dynamicState;
+        pipelineInfo.layout = desc.layout;
+        pipelineInfo.renderPass = desc.renderPass;
+        pipelineInfo.subpass = desc.subpass;
+        pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // 派生パイプラインを使用するかどうか。派生はコピーよりもパフォーマンスが良い
+
+        // キャッシュにヒットすればシェーダのコンパイルが省かれる
+        auto startTime = chrono::steady_clock::now();
+
+        PipelineBuildResult result;
+        if (vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &result.pipeline) != VK_SUCCESS)
+        {
+            throw runtime_error("failed to create graphics pipeline!");
+        }
+
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - startTime;
+        result.compileMs = elapsed.count();
+
+        return result;
+    }
+};
+
+// CpuProfilerが記録する区間 nameは文字列リテラルや__func__など、寿命が静的な文字列であること
+struct CpuEvent
+{
+    const char* name = nullptr;
+    uint64_t startUs = 0;
+    uint64_t durationUs = 0;
+    uint32_t threadIndex = 0;
+};
+
+// CPU側の処理区間を固定長のリングバッファに記録し、Chrome trace形式（chrome://tracing、Perfetto）で出力する
+// 記録はアトミックな書き込み位置を進めて上書きするだけなので、ワーカースレッドからもロックなしで記録できる
+// 容量を超えた場合は古いイベントから上書きされる
+class CpuProfiler
+{
+public:
+    static const uint32_t CAPACITY = 1 << 16; // 2の累乗
+
+    CpuProfiler() : events(CAPACITY), epoch(chrono::steady_clock::now()) {}
+
+    uint64_t nowUs() const
+    {
+        return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - epoch).count();
+    }
+
+    void record(const char* name, uint64_t startUs, uint64_t endUs)
+    {
+        uint64_t index = writeIndex.fetch_add(1, memory_order_relaxed);
+
+        CpuEvent& event = events[index & (CAPACITY - 1)];
+        event.name = name;
+        event.startUs = startUs;
+        event.durationUs = endUs - startUs;
+        event.threadIndex = getThreadIndex();
+    }
+
+    // 記録中のスレッドがない時に呼び出すこと
+    void exportChromeTrace(const string& path) const
+    {
+        uint64_t end = writeIndex.load();
+        uint64_t count = std::min<uint64_t>(end, CAPACITY);
+
+        vector<CpuEvent> sorted;
+        sorted.reserve(count);
+        for (uint64_t i = end - count; i < end; i++)
+        {
+            sorted.push_back(events[i & (CAPACITY - 1)]);
+        }
+        sort(sorted.begin(), sorted.end(), [](const CpuEvent& a, const CpuEvent& b) { return a.startUs < b.startUs; });
+
+        ofstream file(path, ios::trunc);
+        if (!file.is_open())
+        {
+            cout << "failed to write cpu trace: " << path << endl;
+            return;
+        }
+
+        // "X"は開始時刻と所要時間を持つ完結イベント 時間の単位はマイクロ秒
+        file << "{\"traceEvents\":[" << endl;
+        for (size_t i = 0; i < sorted.size(); i++)
+        {
+            const CpuEvent& event = sorted[i];
+            file << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"ts\":" << event.startUs << ",\"dur\":" << event.durationUs
+                 << ",\"pid\":0,\"tid\":" << event.threadIndex << "}" << (i + 1 < sorted.size() ? "," : "") << endl;
+        }
+        file << "]}" << endl;
+
+        cout << "CPU trace: " << sorted.size() << " events written to " << path << endl;
+    }
+
+private:
+    vector<CpuEvent> events;
+    atomic<uint64_t> writeIndex{ 0 };
+    chrono::steady_clock::time_point epoch;
+    atomic<uint32_t> threadCount{ 0 };
+
+    // スレッドごとに0から連番を振る（メインスレッドが最初に記録するため0になる）
+    uint32_t getThreadIndex()
+    {
+        thread_local uint32_t threadIndex = threadCount.fetch_add(1);
+        return threadIndex;
+    }
+};
+
+// スコープの開始から終了（デストラクタまたはend）までを1つのイベントとして記録する
+class CpuScope
+{
+public:
+    CpuScope(CpuProfiler& profiler, const char* name) : profiler(profiler), name(name), startUs(profiler.nowUs()) {}
+
+    ~CpuScope()
+    {
+        end();
+    }
+
+    // スコープの途中で区間を閉じ、所要時間（マイクロ秒）を返す 2回目以降の呼び出しは何もせず0を返す
+    uint64_t end()
+    {
+        if (ended)
+            return 0;
+
+        uint64_t endUs = profiler.nowUs();
+        profiler.record(name, startUs, endUs);
+        ended = true;
+
+        return endUs - startUs;
+    }
+
+private:
+    CpuProfiler& profiler;
+    const char* name;
+    uint64_t startUs;
+    bool ended = false;
+};
+
+// CPU側でフレームの開始時刻を一定間隔に揃えるフレームリミッタ
+// 待機はフレームの先頭（入力の取得より前）で行い、入力から表示までの間に待ち時間が入らないようにする
+// sleepは精度が粗いため、期限の直前まではsleepし、残りはスピンで待つ
+class FrameLimiter
+{
+public:
+    void setTargetFps(double fps)
+    {
+        period = fps > 0.0 ? chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1.0 / fps)) : chrono::steady_clock::duration::zero();
+        nextFrame = chrono::steady_clock::now();
+    }
+
+    bool isEnabled() const
+    {
+        return period != chrono::steady_clock::duration::zero();
+    }
+
+    void waitForNextFrame()
+    {
+        if (!isEnabled())
+            return;
+
+        const auto spinMargin = chrono::milliseconds(1);
+
+        auto now = chrono::steady_clock::now();
+        if (nextFrame - now > spinMargin)
+        {
+            this_thread::sleep_until(nextFrame - spinMargin);
+        }
+        while (chrono::steady_clock::now() < nextFrame)
+        {
+            this_thread::yield();
+        }
+
+        // 1フレーム以上遅れた場合は追いつこうとせず、現在時刻から数え直す
+        nextFrame += period;
+        now = chrono::steady_clock::now();
+        if (now > nextFrame)
+        {
+            nextFrame = now + period;
+        }
+    }
+
+private:
+    chrono::steady_clock::duration period = chrono::steady_clock::duration::zero();
+    chrono::steady_clock::time_point nextFrame;
+};
+
+// フレームごとの時間を蓄積し、パーセンタイルとヒストグラムを出力する
+// frame: 前フレームの開始からの間隔（表示のペース） cpu: drawFrameの所要時間
+// fence / acquire: vkWaitForFences、vkAcquireNextImageKHRでブロックされた時間
+// 長時間実行してもメモリが増えないよう、平均・最大・ヒストグラムは逐次集計し、パーセンタイルは上限付きの標本から求める
+class FrameStats
+{
+public:
+    enum Metric { FRAME, CPU, FENCE, ACQUIRE, METRIC_COUNT };
+
+    void addFrame(double frameMs, double cpuMs, double fenceWaitMs, double acquireWaitMs)
+    {
+        Sample sample = {{ frameMs, cpuMs, fenceWaitMs, acquireWaitMs }};
+
+        for (size_t i = 0; i < METRIC_COUNT; i++)
+        {
+            sums[i] += sample[i];
+            maxima[i] = frameCount == 0 ? sample[i] : std::max(maxima[i], sample[i]);
+        }
+        histogramCounts[upper_bound(bucketLimits, bucketLimits + BUCKET_LIMIT_COUNT, frameMs) - bucketLimits]++;
+        frameCount++;
+
+        // 上限までは全て保持し、以降はframeCount分の1の確率で既存の標本と置き換える（各フレームが等確率で残る）
+        if (reservoir.size() < FRAME_STATS_RESERVOIR_SIZE)
+        {
+            reservoir.push_back(sample);
+        }
+        else
+        {
+            size_t slot = uniform_int_distribution<size_t>(0, frameCount - 1)(random);
+            if (slot < FRAME_STATS_RESERVOIR_SIZE)
+                reservoir[slot] = sample;
+        }
+    }
+
+    size_t getFrameCount() const
+    {
+        return frameCount;
+    }
+
+    void reset()
+    {
+        frameCount = 0;
+        sums.fill(0.0);
+        maxima.fill(0.0);
+        histogramCounts.fill(0);
+        reservoir.clear();
+    }
+
+    void print(const string& title) const
+    {
+        if (frameCount == 0)
+            return;
+
+        cout << "Frame Stats (" << title << ", " << frameCount << " frames, ms):" << endl;
+        printPercentiles("frame", FRAME);
+        printPercentiles("cpu", CPU);
+        printPercentiles("fence", FENCE);
+        printPercentiles("acquire", ACQUIRE);
+        printHistogram();
+    }
+
+private:
+    typedef array<double, METRIC_COUNT> Sample;
+
+    // 上限の区切りは60Hz・30Hzなどのリフレッシュ間隔付近を細かくしている
+    static constexpr double bucketLimits[] = { 1.0, 2.0, 4.0, 7.0, 10.0, 14.0, 17.5, 21.0, 25.0, 34.0, 50.0, 100.0 };
+    static constexpr size_t BUCKET_LIMIT_COUNT = sizeof(bucketLimits) / sizeof(bucketLimits[0]);
+
+    size_t frameCount = 0;
+    Sample sums = {};
+    Sample maxima = {};
+    array<size_t, BUCKET_LIMIT_COUNT + 1> histogramCounts = {}; // 最後のバケットは上限なし
+    vector<Sample> reservoir;
+    minstd_rand random;
+
+    void printPercentiles(const char* name, Metric metric) const
+    {
+        vector<double> samples(reservoir.size());
+        for (size_t i = 0; i < reservoir.size(); i++)
+        {
+            samples[i] = reservoir[i][metric];
+        }
+
+        sort(samples.begin(), samples.end());
+        auto percentile = [&samples](double p)
+        {
+            return samples[static_cast<size_t>(p * (samples.size() - 1) + 0.5)];
+        };
+
+        cout << "\t" << name << ": avg " << sums[metric] / frameCount << ", p50 " << percentile(0.50) << ", p95 " << percentile(0.95)
+             << ", p99 " << percentile(0.99) << ", max " << maxima[metric] << endl;
+    }
+
+    void printHistogram() const
+    {
+        size_t maxCount = *max_element(histogramCounts.begin(), histogramCounts.end());
+        const size_t barWidth = 40;
+
+        cout << "\thistogram (frame):" << endl;
+        for (size_t i = 0; i < histogramCounts.size(); i++)
+        {
+            if (histogramCounts[i] == 0)
+                continue;
+
+            ostringstream range;
+            range << (i == 0 ? 0.0 : bucketLimits[i - 1]) << "-";
+            if (i < BUCKET_LIMIT_COUNT)
+                range << bucketLimits[i];
+            else
+                range << "inf";
+
+            size_t bar = histogramCounts[i] * barWidth / maxCount;
+
+            cout << "\t\t" << range.str() << "\t" << string(std::max<size_t>(bar, 1), '#') << " " << histogramCounts[i] << endl;
+        }
+    }
+};
+
+// GpuProfilerのスコープごとの集計結果（直近GPU_PROFILER_HISTORYフレーム）
+struct GpuScopeStats
+{
+    double minMs = 0.0;
+    double avgMs = 0.0;
+    double maxMs = 0.0;
+    uint32_t samples = 0;
+};
+
+// タイムスタンプクエリでGPU上の区間の所要時間を計測する
+// コマンドバッファごとにスロット（クエリプール）を割り当て、記録時にリセットとタイムスタンプ書き込みを行う
+// 結果は同じスロットを再利用する時点（数フレーム後）でWAIT_BITなしに読み出すため、CPUがGPUを待つことはない
+class GpuProfiler
+{
+public:
+    static const uint32_t MAX_SCOPES = 32;   // 1スロットあたりのスコープ数の上限
+    static const uint32_t HISTORY = 120;     // 集計に使う直近のサンプル数
+
+    void init(VkDevice device, const DeviceCapabilities& deviceCaps, uint32_t queueFamilyIndex, uint32_t slotCount)
+    {
+        this->device = device;
+
+        timestampPeriod = deviceCaps.properties.limits.timestampPeriod; // 1カウントあたりのナノ秒
+
+        // timestampValidBitsが0のキューではタイムスタンプを書き込めない
+        timestampValidBits = deviceCaps.queueFamilies[queueFamilyIndex].timestampValidBits;
+        if (timestampValidBits == 0)
+        {
+            cout << "GPU Profiler: timestamps are not supported on the graphics queue" << endl;
+            return;
+        }
+
+        VkQueryPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        poolInfo.queryCount = MAX_SCOPES * 2; // スコープごとに開始と終了
+
+        slots.resize(slotCount);
+        for (auto& slot : slots)
+        {
+            if (vkCreateQueryPool(device, &poolInfo, nullptr, &slot.queryPool) != VK_SUCCESS)
+            {
+                throw runtime_error("failed to create timestamp query pool!");
+            }
+        }
+    }
+
+    bool isEnabled() const
+    {
+        return !slots.empty();
+    }
+
+    // コマンドバッファの記録開始時に呼び出す。前回の結果は先にcollectで回収しておくこと
+    // スロット数を超えるインデックス（スワップチェーン再構築でイメージが増えた場合など）は計測しない
+    void beginFrame(VkCommandBuffer commandBuffer, uint32_t slotIndex)
+    {
+        recordingSlot = UINT32_MAX;
+        if (!isEnabled() || slotIndex >= slots.size())
+            return;
+
+        Slot& slot = slots[slotIndex];
+        slot.scopeNames.clear();
+        recordingSlot = slotIndex;
+
+        // クエリは書き込み前にリセットが必要 レンダーパスの外で記録すること
+        vkCmdResetQueryPool(commandBuffer, slot.queryPool, 0, MAX_SCOPES * 2);
+    }
+
+    // 戻り値はendScopeに渡す スコープ数が上限を超えた場合は計測しない
+    // beginFrameとcollectの間であれば、ワーカースレッドが記録するセカンダリコマンドバッファからも呼び出せる
+    uint32_t beginScope(VkCommandBuffer commandBuffer, const string& name)
+    {
+        if (recordingSlot == UINT32_MAX)
+            return UINT32_MAX;
+
+        Slot& slot = slots[recordingSlot];
+        uint32_t scopeIndex;
+        {
+            lock_guard<mutex> lock(scopeMutex);
+            if (slot.scopeNames.size() >= MAX_SCOPES)
+                return UINT32_MAX;
+
+            scopeIndex = static_cast<uint32_t>(slot.scopeNames.size());
+            slot.scopeNames.push_back(name);
+        }
+
+        // TOP_OF_PIPEは先行するコマンドの完了を待たず、この位置に到達した時点の値を書き込む
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, slot.queryPool, scopeIndex * 2);
+        return scopeIndex;
+    }
+
+    void endScope(VkCommandBuffer commandBuffer, uint32_t scopeIndex)
+    {
+        if (scopeIndex == UINT32_MAX)
+            return;
+
+        Slot& slot = slots[recordingSlot];
+
+        // BOTTOM_OF_PIPEは先行する全コマンドの完了後に書き込まれる
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, slot.queryPool, scopeIndex * 2 + 1);
+    }
+
+    // スロットのコマンドバッファを提出したことを記録する 事前記録したコマンドバッファは毎回提出されるたびに計測される
+    void markSubmitted(uint32_t slotIndex)
+    {
+        if (slotIndex < slots.size())
+            slots[slotIndex].pending = true;
+    }
+
+    // スロットの前回の提出分の結果を読み出して集計に加える GPUが未完了ならVK_NOT_READYとなり、次の機会に読み出す
+    void collect(uint32_t slotIndex)
+    {
+        if (slotIndex >= slots.size() || !slots[slotIndex].pending)
+            return;
+
+        Slot& slot = slots[slotIndex];
+        uint32_t queryCount = static_cast<uint32_t>(slot.scopeNames.size()) * 2;
+        if (queryCount == 0)
+        {
+            slot.pending = false;
+            return;
+        }
+
+        vector<uint64_t> timestamps(queryCount);
+        VkResult result = vkGetQueryPoolResults(device, slot.queryPool, 0, queryCount, timestamps.size() * sizeof(uint64_t),
+            timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+        if (result != VK_SUCCESS)
+            return;
+
+        slot.pending = false;
+
+        // 有効ビット数が64未満の場合、上位ビットは不定のためマスクする
+        uint64_t mask = timestampValidBits >= 64 ? UINT64_MAX : ((uint64_t(1) << timestampValidBits) - 1);
+
+        for (size_t i = 0; i < slot.scopeNames.size(); i++)
+        {
+            uint64_t begin = timestamps[i * 2] & mask;
+            uint64_t end = timestamps[i * 2 + 1] & mask;
+            double elapsedMs = static_cast<double>((end - begin) & mask) * timestampPeriod / 1000000.0;
+
+            deque<double>& history = histories[slot.scopeNames[i]];
+            history.push_back(elapsedMs);
+            if (history.size() > HISTORY)
+                history.pop_front();
+        }
+    }
+
+    GpuScopeStats getScopeStats(const string& name) const
+    {
+        GpuScopeStats stats;
+
+        auto it = histories.find(name);
+        if (it == histories.end() || it->second.empty())
+            return stats;
+
+        const deque<double>& history = it->second;
+        stats.minMs = *min_element(history.begin(), history.end());
+        stats.maxMs = *max_element(history.begin(), history.end());
+        for (double sample : history)
+        {
+            stats.avgMs += sample;
+        }
+        stats.avgMs /= history.size();
+        stats.samples = static_cast<uint32_t>(history.size());
+
+        return stats;
+    }
+
+    void printStats() const
+    {
+        if (!isEnabled())
+            return;
+
+        cout << "GPU Timings (last " << HISTORY << " frames, ms):" << endl;
+        for (const auto& history : histories)
+        {
+            GpuScopeStats stats = getScopeStats(history.first);
+            cout << "\t" << history.first << ": min " << stats.minMs << ", avg " << stats.avgMs << ", max " << stats.maxMs
+                 << " (" << stats.samples << " samples)" << endl;
+        }
+    }
+
+    void destroy()
+    {
+        for (auto& slot : slots)
+        {
+            vkDestroyQueryPool(device, slot.queryPool, nullptr);
+        }
+        slots.clear();
+    }
+
+private:
+    struct Slot
+    {
+        VkQueryPool queryPool = VK_NULL_HANDLE;
+        vector<string> scopeNames; // 記録したスコープ（クエリ番号 = インデックス * 2）
+        bool pending = false;      // 提出済みで未回収の結果がある
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    float timestampPeriod = 1.0f;
+    uint32_t timestampValidBits = 0;
+    vector<Slot> slots;
+    uint32_t recordingSlot = UINT32_MAX; // beginFrame中のスロット beginFrameはメインスレッドのみで呼ぶ
+    mutex scopeMutex;                    // ワーカースレッドからのbeginScopeを保護する
+    map<string, deque<double>> histories;
+};
+
+class HelloTriangleApplication
+{
+public:
+    explicit HelloTriangleApplication(const AppConfig& config) : config(config) {}
+
+    void run()
+    {
+        initWindow();
+        initVulkan();
+        mainLoop();
+        cleanup();
+    }
+
+private:
+    AppConfig config;
+    GLFWwindow* window = nullptr; // ヘッドレス時はnullptr
+    VkInstance instance;
+    VkDebugUtilsMessengerEXT callback;
+    VkPhysicalDevice physicalDevice = VK_NULL_HANDLE; // physicalDevice は instance に紐づくため、instance 解放時に自動解放される（明示的解放不要）
+    DeviceCapabilities deviceCaps; // physicalDeviceの情報 pickPhysicalDeviceで1度だけ取得する
+    set<string> enabledDeviceExtensions; // 論理デバイス作成時に有効化した拡張（オプションの拡張を含む）
+    bool uint8IndicesEnabled = false;    // VK_EXT_index_type_uint8のindexTypeUint8機能を有効化した
+    VkDevice device = VK_NULL_HANDLE; // 論理デバイスの作成時にcreateinfoを使用するため、明示的に解放する必要があります
+    VkQueue graphicsQueue; // コマンドキューは論理デバイスの作成時に生成され、deviceの解放時に自動的に解放されます（明示的な解放不要）
+    VkQueue presentQueue;
+    VkQueue transferQueue; // 転送専用キュー族がなければgraphicsQueueと同じ
+    VkQueue computeQueue;  // 非同期コンピュート用キュー族がなければgraphicsQueueと同じ
+    VkSurfaceKHR surface = VK_NULL_HANDLE; // ヘッドレス時はVK_NULL_HANDLE
+    VkSwapchainKHR swapChain = VK_NULL_HANDLE; // 再構築時はoldSwapchainとして新しいスワップチェーンに渡す
+    vector<VkImage> swapChainImages; // ヘッドレス時はオフスクリーンイメージのリング
+    vector<MemoryAllocation> offscreenImageMemory; // オフスクリーンイメージはスワップチェーンと違い自前でメモリを確保する
+    VkFormat swapChainImageFormat;
+    VkExtent2D swapChainExtent;
+    vector<VkImageView> swapChainImageViews;
+    VkPipelineLayout pipelineLayout; // 固定機能の管理に使用
+    VkRenderPass renderPass;
+    VkPipeline graphicsPipeline = VK_NULL_HANDLE; // ワーカースレッドでの構築が完了するまではVK_NULL_HANDLE
+    shared_future<PipelineBuildResult> graphicsPipelineFuture;
+    vector<VkShaderModule> pendingShaderModules; // パイプライン構築完了後に破棄
+    VkPipelineCache pipelineCache; // コンパイル済みパイプラインのキャッシュ（ドライバ依存のバイナリ）
+    bool pipelineCacheWarm = false; // ディスクから有効なキャッシュを読み込めたか
+    WorkerPool workerPool; // パイプライン構築などを並列実行するワーカースレッド
+    WorkerPool recordWorkerPool; // セカンダリコマンドバッファ記録専用（パイプライン構築の後ろに並ばないよう分ける）
+    PipelineBuilder pipelineBuilder;
+    vector<VkFramebuffer> swapChainFramebuffers;  // 1つのattachmentが複数のswapchain画像に対応する可能性があるため、複数のframebufferが必要
+    VkCommandPool commandPool; // コマンドプールはCommand Bufferの割り当て・管理用メモリコンテナ
+    
+    DeviceMemoryAllocator memoryAllocator; // バッファのメモリは大きなVkDeviceMemoryブロックから切り出す
+
+    // 全メッシュの頂点とインデックスを格納する1つのバッファ 配置はmeshArenaが決める
+    // インデックスバッファは1つしか持たず、そのインデックス値は全ての頂点属性（位置、法線、UV座標など）に適用される
+    MeshArena meshArena{ sizeof(Vertex) };
+    VkBuffer meshBuffer; // 論理バッファオブジェクト バッファの論理属性と用途を定義
+    MemoryAllocation meshBufferMemory; // 実際のメモリ割り当てと管理（VRAMまたはホストメモリ）、データ格納
+
+    VkBuffer stagingRingBuffer; // 全アップロードで共有する永続マップ済みステージングバッファ
+    MemoryAllocation stagingRingMemory;
+    StagingRing stagingRing;
+    UploadQueue uploadQueue; // コピーをまとめて提出し、完了はチケットで追跡する
+    UploadTicket meshUploadTicket; // メッシュバッファのアップロード完了チケット 初回描画前にのみ待つ
+    int directUploadMemoryType = -1; // 直接書き込みに使うDEVICE_LOCAL | HOST_VISIBLEのメモリタイプ 無ければ-1（ステージング経由）
+    
+    vector <VkCommandBuffer> commandBuffers; // Command BufferはGPUコマンド格納用コンテナ（描画/計算/メモリ操作命令記録用）
+
+    // 静的なシーンでは毎フレーム同じコマンドを記録することになるため、フレームバッファ（スワップチェーンイメージ）ごとに事前記録しておく
+    vector<VkCommandBuffer> swapChainCommandBuffers; // イメージ x インスタンススライスごと（getSwapChainCommandBufferIndex）
+    vector<bool> swapChainCommandBufferDirty;         // trueなら次に使う前に記録し直す
+    vector<VkFence> imagesInFlight;                   // 各イメージのコマンドバッファを最後に提出したフレームのフェンス
+
+    // コマンドプールは外部同期が必要なため、ワーカースレッドごと・並列フレームごとに専用のプールを持つ
+    // [フレーム][ワーカー] 並列フレームごとに分けることで、GPUが使用中のフレームのプールに触れずにリセットできる
+    struct ThreadCommandPool
+    {
+        VkCommandPool pool = VK_NULL_HANDLE;
+        vector<VkCommandBuffer> secondaryBuffers; // リセット後も再利用する
+        uint32_t usedCount = 0;
+    };
+    vector<vector<ThreadCommandPool>> threadCommandPools;
+
+    vector<DrawItem> drawItems; // シーン内の描画一覧 instanceBatcherのバッチと1対1
+
+    vector<SceneObject> sceneObjects;
+    InstanceBatcher instanceBatcher;
+    chrono::steady_clock::time_point sceneStartTime;
+
+    // インスタンスバッファは描画が読むDEVICE_LOCALのバッファで、並列フレームごとの領域（スライス）に分ける
+    // 毎フレーム、同じフレームのステージング領域からフレームのコマンドの先頭でコピーし、描画はそのスライスをバインドする
+    // スライスを読んだ前回の提出はこのフレームのフェンスで完了済みのため、上書き前の頂点入力との同期は要らない
+    // アニメーションしない場合はスライス1つをロード時にアップロードキューで転送し、毎フレームのコピーはしない
+    VkBuffer instanceBuffer;
+    MemoryAllocation instanceBufferMemory;
+    VkBuffer instanceStagingBuffer = VK_NULL_HANDLE; // HOST_VISIBLE 並列フレーム数 x instanceCapacity（アニメーションする場合のみ）
+    MemoryAllocation instanceStagingMemory;
+    uint32_t instanceCapacity = 0;
+    bool animateInstances = false;    // インスタンスデータを毎フレーム更新するか
+    uint32_t instanceSliceCount = 1;  // animateInstancesなら並列フレーム数、そうでなければ1
+    UploadTicket instanceUploadTicket; // 静的なインスタンスデータのアップロード完了チケット
+    vector<VkCommandBuffer> instanceUpdateCommandBuffers; // 並列フレームごと（アニメーションする場合のみ）
+
+    // drawItemsと同じ順のVkDrawIndexedIndirectCommandの配列と、その後ろにインデックス型ごとの描画数を格納するバッファ
+    // 現在はCPUで作成してアップロードする 将来はコンピュートシェーダでカリングしてコマンドと描画数を書き込む（GPU駆動描画）
+    bool useIndirectDraws = false;
+    VkBuffer indirectBuffer = VK_NULL_HANDLE;
+    MemoryAllocation indirectBufferMemory;
+    VkDeviceSize indirectCountOffset = 0;
+    vector<IndirectDrawGroup> indirectGroups;
+    UploadTicket indirectUploadTicket;
+    PFN_vkCmdDrawIndexedIndirectCountKHR cmdDrawIndexedIndirectCount = nullptr; // VK_KHR_draw_indirect_countが無ければnullptr
+    // 描画数をGPUが書き込む場合のみCount版を使う（GPUカリングのための下準備）
+    // 現在の描画数はCPUが書いたcommandCountと常に等しいため、Count版を使っても得るものはない
+    bool gpuWrittenDrawCounts = false;
+
+    CpuProfiler cpuProfiler; // 起動処理と各フレームの段階ごとのCPU時間を記録
+
+    FrameLimiter frameLimiter;
+    FrameStats frameStatsWindow; // 直近FRAME_STATS_REPORT_SECONDS秒分 出力するたびにリセット
+    FrameStats frameStatsTotal;  // 起動から終了まで
+    chrono::steady_clock::time_point lastFrameStart;
+    chrono::steady_clock::time_point lastStatsReport;
+    double lastFenceWaitMs = 0.0;   // drawFrameが書き込む
+    double lastAcquireWaitMs = 0.0;
+    GpuProfiler gpuProfiler; // スロットはPreRecordedならスワップチェーンイメージ、それ以外は並列フレームに対応
+
+    // VulkanのAPI呼び出しの大部分は非同期であるため、明示的に同期を実装する必要があります
+    vector <VkSemaphore> imageAvailableSemaphores; // GPU内の各コマンド間の同期を実現
+    vector <VkSemaphore> renderFinishedSemaphores; // GPU内の各コマンド間の同期を実現
+    vector <VkFence> inFlightFences; // CPUとGPU間の同期を実現
+    uint32_t currentFrame = 0; // 現在処理中の並列フレームを識別
+
+    // 提出したフレームに通し番号を振り、GPUで完了したフレームを追跡する（単一キューなので完了は提出順）
+    uint64_t submittedFrameCount = 0;
+    uint64_t completedFrameCount = 0;
+    vector<uint64_t> frameSubmitCounts; // 各並列フレームに最後に提出したフレームの通し番号
+
+    // 再構築で置き換えられたスワップチェーン一式 最後に使用したフレームが完了するまで破棄を遅らせる
+    struct RetiredSwapChain
+    {
+        VkSwapchainKHR swapChain = VK_NULL_HANDLE;
+        vector<VkImageView> imageViews;
+        vector<VkFramebuffer> framebuffers;
+        vector<VkCommandBuffer> commandBuffers; // 古いフレームバッファを参照する事前記録済みコマンドバッファ
+        uint64_t lastFrame = 0;                 // この通し番号のフレームが完了したら破棄できる
+    };
+    deque<RetiredSwapChain> retiredSwapChains;
+
+    bool framebufferResized = false;
+
+    void initWindow()
+    {
+        if (config.headless)
+            return;
+
+        glfwInit();
+
+        glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API); // GLFWが自動的にOpenGLコンテキストを作成しないように設定する
+
+        window = glfwCreateWindow(WIDTH, HEIGHT, "koalahjf@gmail.com", nullptr, nullptr);
+        glfwSetWindowUserPointer(window, this);
+        glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+    }
+
+    // VK_ERROR_OUT_OF_DATE_KHRはリサイズ発生を保証しないため、glfwSetFramebufferSizeCallbackで明示的に処理する必要がある
+    static void framebufferResizeCallback(GLFWwindow* window, int width, int height) 
+    {
+        auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
+        app->framebufferResized = true;
+    }
+
+
+    void initVulkan()
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+
         createInstance();
         setDebugCallback();
         createSurface();
         pickPhysicalDevice();
         createLogicalDevice();
+        createMemoryAllocator();
         createSwapChain();
         createImageViews();
         createRenderPass();
+        createPipelineCache();
+        createWorkerPool();
+        createPipelineBuilder();
         createGraphicsPipeline();
         createFramebuffers();
         createCommandPool();
-        createVertexBuffer();
-        createIndexBuffer();
+        createThreadCommandPools();
+        createUploadQueue();
+        createStagingRing();
+        createMeshBuffer();
+        createSceneObjects();
+        createInstanceBuffers();
+        createDrawItems();
+        createIndirectBuffer();
+        flushUploads();
         createCommandBuffers();
+        createSwapChainCommandBuffers();
         createSyncObjects();
+        createGpuProfiler();
     }
 
     void setDebugCallback()
     {
+        CpuScope cpuScope(cpuProfiler, __func__);
         if (!enableValidationLayers)
             return;
 
@@ -226,16 +2895,72 @@ private:
 
     void mainLoop()
     {
+        if (config.headless)
+        {
+            runBenchmark();
+            return;
+        }
+
+        frameLimiter.setTargetFps(config.fpsLimit);
+
         while (!glfwWindowShouldClose(window))
         {
+            // 待機を入力の取得より前に行い、取得した入力をすぐに描画へ反映させる
+            frameLimiter.waitForNextFrame();
             glfwPollEvents();
-            drawFrame();
+            runFrame();
         }
 
         // ウィンドウが閉じられた後、同期オブジェクトを破棄(cleanup) GPU内の非同期コマンドがまだ完了していない可能性があるため、エラーが発生する
         vkDeviceWaitIdle(device); 
     }
 
+    // 1フレーム描画し、フレーム統計に記録する 一定間隔で直近の統計を出力する
+    void runFrame()
+    {
+        auto frameStart = chrono::steady_clock::now();
+        drawFrame();
+        auto frameEnd = chrono::steady_clock::now();
+
+        if (lastStatsReport == chrono::steady_clock::time_point())
+            lastStatsReport = frameStart;
+
+        double cpuMs = chrono::duration<double, milli>(frameEnd - frameStart).count();
+        double frameMs = lastFrameStart == chrono::steady_clock::time_point() ? cpuMs : chrono::duration<double, milli>(frameStart - lastFrameStart).count();
+        lastFrameStart = frameStart;
+
+        frameStatsWindow.addFrame(frameMs, cpuMs, lastFenceWaitMs, lastAcquireWaitMs);
+        frameStatsTotal.addFrame(frameMs, cpuMs, lastFenceWaitMs, lastAcquireWaitMs);
+
+        if (chrono::duration<double>(frameEnd - lastStatsReport).count() >= FRAME_STATS_REPORT_SECONDS)
+        {
+            frameStatsWindow.print("last " + to_string(static_cast<int>(FRAME_STATS_REPORT_SECONDS)) + " s");
+            frameStatsWindow.reset();
+
+            // 他プロセスの使用量で予算は変動するため、定期的に読み直して逼迫していれば警告する
+            memoryAllocator.updateBudgets();
+            lastStatsReport = frameEnd;
+        }
+    }
+
+    // 指定フレーム数を描画し、フレームレートを出力する フレーム時間の分布は終了時にframeStatsTotalとして出力される
+    void runBenchmark()
+    {
+        auto benchmarkStart = chrono::steady_clock::now();
+        for (uint32_t i = 0; i < config.benchmarkFrames; i++)
+        {
+            runFrame();
+        }
+
+        // 最後のフレームがGPUで完了するまでを計測に含める
+        vkDeviceWaitIdle(device);
+        double totalSeconds = chrono::duration<double>(chrono::steady_clock::now() - benchmarkStart).count();
+
+        cout << "Headless Benchmark:" << endl;
+        cout << "\tframes: " << config.benchmarkFrames << " in " << totalSeconds << " s" << endl;
+        cout << "\tfps: " << config.benchmarkFrames / totalSeconds << endl;
+    }
+
     void cleanupSwapChain() 
     {
         for (auto framebuffer : swapChainFramebuffers) 
@@ -248,52 +2973,131 @@ private:
             vkDestroyImageView(device, imageView, nullptr);
         }
 
+        if (config.headless)
+        {
+            for (size_t i = 0; i < swapChainImages.size(); i++)
+            {
+                vkDestroyImage(device, swapChainImages[i], nullptr);
+                memoryAllocator.release(offscreenImageMemory[i]);
+            }
+            offscreenImageMemory.clear();
+            return;
+        }
+
         vkDestroySwapchainKHR(device, swapChain, nullptr);
     }
 
     void cleanup()
     {
+        // 構築中のパイプラインを完了させてからワーカースレッドを終了する
+        recordWorkerPool.destroy();
+        workerPool.destroy();
+        try
+        {
+            resolveGraphicsPipeline();
+        }
+        catch (const exception& e)
+        {
+            // 構築に失敗していても破棄は続ける（例外を投げると以降のリソースがリークする）
+            cerr << "graphics pipeline build failed: " << e.what() << endl;
+        }
+
+        // 構築に失敗した場合はresolveGraphicsPipelineで解放されずに残る
+        for (auto shaderModule : pendingShaderModules)
+        {
+            vkDestroyShaderModule(device, shaderModule, nullptr);
+        }
+        pendingShaderModules.clear();
+
         // リソースの破棄と作成の順序は正確に逆にする必要がある
+        destroyRetiredSwapChains(true); // mainLoopの最後にvkDeviceWaitIdle済み
         cleanupSwapChain();
 
         // 同期オブジェクトを破棄する前にGPU操作が完了していることを確認、そうでないとエラーになる
-        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) 
+        for (size_t i = 0; i < config.framesInFlight; i++) 
         {
-            vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
-            vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
+            if (!config.headless)
+            {
+                vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
+                vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
+            }
             vkDestroyFence(device, inFlightFences[i], nullptr);
         }
 
-        vkDestroyBuffer(device, indexBuffer, nullptr);
-        vkFreeMemory(device, indexBufferMemory, nullptr);
+        memoryAllocator.printStats();
+        gpuProfiler.printStats();
+        frameStatsTotal.print("total");
+
+        vkDestroyBuffer(device, meshBuffer, nullptr);
+        memoryAllocator.release(meshBufferMemory);
+
+        vkDestroyBuffer(device, instanceBuffer, nullptr);
+        memoryAllocator.release(instanceBufferMemory);
+
+        vkDestroyBuffer(device, instanceStagingBuffer, nullptr);
+        memoryAllocator.release(instanceStagingMemory);
+
+        if (indirectBuffer != VK_NULL_HANDLE)
+        {
+            vkDestroyBuffer(device, indirectBuffer, nullptr);
+            memoryAllocator.release(indirectBufferMemory);
+        }
+
+        vkDestroyBuffer(device, stagingRingBuffer, nullptr);
+        memoryAllocator.release(stagingRingMemory);
 
-        vkDestroyBuffer(device, vertexBuffer, nullptr);
-        vkFreeMemory(device, vertexBufferMemory, nullptr);
+        uploadQueue.destroy();
+
+        for (auto& framePools : threadCommandPools)
+        {
+            for (auto& threadPool : framePools)
+            {
+                vkDestroyCommandPool(device, threadPool.pool, nullptr); // セカンダリコマンドバッファも一緒に解放される
+            }
+        }
 
         vkDestroyCommandPool(device, commandPool, nullptr);
 
         vkDestroyPipeline(device, graphicsPipeline, nullptr);
 
+        savePipelineCache();
+        vkDestroyPipelineCache(device, pipelineCache, nullptr);
+
         vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
 
         vkDestroyRenderPass(device, renderPass, nullptr);
 
+        gpuProfiler.destroy();
+
+        // ブロックの解放はdevice破棄の前に行う
+        memoryAllocator.destroy();
+
         vkDestroyDevice(device, nullptr);
 
-        vkDestroySurfaceKHR(instance, surface, nullptr);
+        if (surface != VK_NULL_HANDLE)
+            vkDestroySurfaceKHR(instance, surface, nullptr);
 
         if (enableValidationLayers)
             DestroyDebugUtilsMessengerEXT(instance, callback, nullptr);
 
         vkDestroyInstance(instance, nullptr);
 
-        glfwDestroyWindow(window);
+        if (!config.headless)
+        {
+            glfwDestroyWindow(window);
+
+            glfwTerminate();
+        }
 
-        glfwTerminate();
+        // ワーカースレッドは終了済みのため、記録中のスレッドはない
+        if (!config.traceFile.empty())
+            cpuProfiler.exportChromeTrace(config.traceFile);
     }
 
     void recreateSwapChain() 
     {
+        CpuScope cpuScope(cpuProfiler, __func__);
+
         int width = 0, height = 0;
         glfwGetFramebufferSize(window, &width, &height);
 
@@ -304,19 +3108,55 @@ private:
             glfwWaitEvents();
         }
 
-        // GPU処理完了を待ってからクリーンアップ
-        vkDeviceWaitIdle(device);
-
-        cleanupSwapChain();
+        // vkDeviceWaitIdleでGPUを空にする代わりに、古いスワップチェーン一式は使用中のフレームが完了するまで保留し、後で破棄する
+        RetiredSwapChain retired;
+        retired.swapChain = swapChain;
+        retired.imageViews = move(swapChainImageViews);
+        retired.framebuffers = move(swapChainFramebuffers);
+        retired.commandBuffers = move(swapChainCommandBuffers); // 古いフレームバッファを参照しているため作り直す（イメージ数が変わる場合もある）
+        retired.lastFrame = submittedFrameCount; // これまでに提出したフレームが全て完了すれば、古いリソースはもう参照されない
 
-        // スワップチェーンの再作成
+        // スワップチェーンの再作成 swapChainはoldSwapchainとして渡され、ドライバがリソースを引き継げる
         createSwapChain();
         createImageViews();
         createFramebuffers();
+        createSwapChainCommandBuffers(); // 新しいコマンドバッファは全てdirty状態で作成される
+
+        // oldSwapchainに渡したスワップチェーンはretired状態になり、新たにイメージを取得できないが、取得済みイメージの表示は完了できる
+        retiredSwapChains.push_back(move(retired));
+    }
+
+    // 最後に使用したフレームが完了した古いスワップチェーン一式を破棄する forceはGPUがアイドルの時のみ
+    void destroyRetiredSwapChains(bool force = false)
+    {
+        while (!retiredSwapChains.empty() && (force || retiredSwapChains.front().lastFrame <= completedFrameCount))
+        {
+            RetiredSwapChain& retired = retiredSwapChains.front();
+
+            if (!retired.commandBuffers.empty())
+            {
+                vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(retired.commandBuffers.size()), retired.commandBuffers.data());
+            }
+
+            for (auto framebuffer : retired.framebuffers)
+            {
+                vkDestroyFramebuffer(device, framebuffer, nullptr);
+            }
+
+            for (auto imageView : retired.imageViews)
+            {
+                vkDestroyImageView(device, imageView, nullptr);
+            }
+
+            vkDestroySwapchainKHR(device, retired.swapChain, nullptr);
+
+            retiredSwapChains.pop_front();
+        }
     }
 
     void createInstance()
     {
+        CpuScope cpuScope(cpuProfiler, __func__);
         // VkApplicationInfo は必須ではないが、ドライバの最適化に利用される可能性がある
         VkApplicationInfo appInfo{};
         appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
@@ -324,7 +3164,7 @@ private:
         appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
         appInfo.pEngineName = "No Engine";
         appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-        appInfo.apiVersion = VK_API_VERSION_1_0;
+        appInfo.apiVersion = VK_API_VERSION_1_1; // vkGetPhysicalDeviceProperties2などのクエリ用
 
         // VkInstanceCreateInfo は必須入力項目
         VkInstanceCreateInfo createInfo{};
@@ -402,10 +3242,14 @@ private:
     vector<const char*> getExtensions()
     {
         // 必要な拡張機能を取得
-        // GLFWは必須
-        uint32_t glfwExtensionCount = 0;
-        const char** glfwExtension = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-        vector<const char*> extensions(glfwExtension, glfwExtension + glfwExtensionCount);
+        // GLFWは必須（ヘッドレス時はサーフェスを作らないため不要）
+        vector<const char*> extensions;
+        if (!config.headless)
+        {
+            uint32_t glfwExtensionCount = 0;
+            const char** glfwExtension = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+            extensions.assign(glfwExtension, glfwExtension + glfwExtensionCount);
+        }
 
         // 検証レイヤーが有効な場合、デバッグ情報取得のためVK_EXT_debug_utils拡張を有効化
         // 検証レイヤーの利用可能性がVK_EXT_debug_utilsのサポートを暗黙的に保証する為、明示的なチェックは不要
@@ -492,6 +3336,7 @@ private:
 
     void pickPhysicalDevice()
     {
+        CpuScope cpuScope(cpuProfiler, __func__);
         uint32_t count = 0;
         vkEnumeratePhysicalDevices(instance, &count, nullptr);
         if (count == 0)
@@ -499,88 +3344,315 @@ private:
         vector<VkPhysicalDevice> devices(count);
         vkEnumeratePhysicalDevices(instance, &count, devices.data());
 
+        // 全デバイスの評価を出力し、選択の根拠を確認できるようにする
+        vector<DeviceCapabilities> candidates;
+        vector<PhysicalDeviceRating> ratings;
+        cout << "Physical Devices:" << endl;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            candidates.push_back(queryDeviceCapabilities(devices[i]));
+            PhysicalDeviceRating rating = ratePhyicalDevice(candidates[i]);
 
-        multimap<int, const VkPhysicalDevice&> candidates;
+            cout << "\t[" << i << "] " << candidates[i].properties.deviceName << " (uuid " << candidates[i].deviceUUID << ")" << endl;
+            cout << "\t\t" << (rating.suitable ? "score " + to_string(rating.score) : string("unsuitable")) << ":";
+            for (const auto& reason : rating.reasons)
+            {
+                cout << " " << reason << ";";
+            }
+            cout << endl;
 
-        for (const auto& device : devices)
-        {
-            candidates.insert(make_pair(ratePhyicalDevice(device), device));
+            ratings.push_back(rating);
         }
 
-        // multimap はデフォルトでキーの昇順ソート（最終要素のキー値が最大）
-        // ※ end() は使用不可
-        if (candidates.rbegin()->first > 0)
+        int selected = -1;
+        if (!config.gpu.empty())
         {
-            physicalDevice = candidates.rbegin()->second;
+            // マルチGPU環境向けに、名前（部分一致）・UUID・列挙順のインデックスで明示的に指定できる
+            for (uint32_t i = 0; i < count && selected < 0; i++)
+            {
+                if (matchesDeviceOverride(candidates[i], i, config.gpu))
+                    selected = static_cast<int>(i);
+            }
+
+            if (selected < 0)
+                throw runtime_error("no physical device matches --gpu " + config.gpu);
+            if (!ratings[selected].suitable)
+                throw runtime_error("physical device selected by --gpu " + config.gpu + " is not suitable!");
         }
         else
         {
-            throw runtime_error("failed to get suitable physical device!");
+            for (uint32_t i = 0; i < count; i++)
+            {
+                if (ratings[i].suitable && (selected < 0 || ratings[i].score > ratings[selected].score))
+                    selected = static_cast<int>(i);
+            }
+
+            if (selected < 0)
+                throw runtime_error("failed to get suitable physical device!");
         }
+
+        deviceCaps = candidates[selected];
+        physicalDevice = deviceCaps.physicalDevice;
+
+        cout << "Selected Device: [" << selected << "] " << deviceCaps.properties.deviceName << (config.gpu.empty() ? " (highest score)" : " (--gpu)") << endl;
+        printDeviceCapabilities();
     }
 
-    int ratePhyicalDevice(const VkPhysicalDevice& device)
+    DeviceCapabilities queryDeviceCapabilities(VkPhysicalDevice device)
     {
-        VkPhysicalDeviceProperties properties;
-        VkPhysicalDeviceFeatures features;
-        vkGetPhysicalDeviceProperties(device, &properties);
-        vkGetPhysicalDeviceFeatures(device, &features);
+        DeviceCapabilities caps;
+        caps.physicalDevice = device;
 
-        multimap<int, const VkPhysicalDevice&> candidates;
-        int score = 0;
+        vkGetPhysicalDeviceProperties(device, &caps.properties);
+        vkGetPhysicalDeviceFeatures(device, &caps.features);
+        vkGetPhysicalDeviceMemoryProperties(device, &caps.memoryProperties);
 
-        // ディスクリートGPU 
-        if (properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU)
-            score += 1000;
+        uint32_t count = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(device, &count, nullptr);
+        caps.queueFamilies.resize(count);
+        vkGetPhysicalDeviceQueueFamilyProperties(device, &count, caps.queueFamilies.data());
 
-        // 2Dテクスチャ品質
-        score += properties.limits.maxImageDimension2D;
+        caps.queueFamilyIndices = findQueueFamilyIndices(device, caps.queueFamilies);
+        caps.extensions = getAvailableDeviceExtensions(device);
+        caps.deviceUUID = getDeviceUUID(device, caps.properties);
 
-        // ジオメトリシェーダ　必須
-        if (features.geometryShader == false)
-            return 0;
+        // 拡張の機能はvkGetPhysicalDeviceFeatures2（Vulkan 1.1）で問い合わせる
+        if (caps.hasExtension(VK_EXT_INDEX_TYPE_UINT8_EXTENSION_NAME) && caps.properties.apiVersion >= VK_API_VERSION_1_1)
+        {
+            VkPhysicalDeviceIndexTypeUint8FeaturesEXT uint8Features{};
+            uint8Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_INDEX_TYPE_UINT8_FEATURES_EXT;
+
+            VkPhysicalDeviceFeatures2 features2{};
+            features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+            features2.pNext = &uint8Features;
+            vkGetPhysicalDeviceFeatures2(device, &features2);
+
+            caps.indexTypeUint8 = uint8Features.indexTypeUint8 == VK_TRUE;
+        }
+
+        // サーフェスのフォーマットと表示モードは変わらないため保持する（capabilitiesはウィンドウサイズで変わるため都度取得）
+        if (!config.headless)
+        {
+            uint32_t formatCount = 0;
+            vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &formatCount, nullptr);
+            caps.surfaceFormats.resize(formatCount);
+            vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &formatCount, caps.surfaceFormats.data());
+
+            uint32_t presentModeCount = 0;
+            vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface, &presentModeCount, nullptr);
+            caps.presentModes.resize(presentModeCount);
+            vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface, &presentModeCount, caps.presentModes.data());
+        }
+
+        return caps;
+    }
+
+    void printDeviceCapabilities()
+    {
+        const VkPhysicalDeviceProperties& properties = deviceCaps.properties;
+
+        cout << "Device Capabilities:" << endl;
+        cout << "\tapi: " << VK_VERSION_MAJOR(properties.apiVersion) << "." << VK_VERSION_MINOR(properties.apiVersion)
+             << "." << VK_VERSION_PATCH(properties.apiVersion) << ", driver: " << properties.driverVersion
+             << ", vendor: 0x" << hex << properties.vendorID << ", device: 0x" << properties.deviceID << dec << endl;
+
+        for (uint32_t i = 0; i < deviceCaps.memoryProperties.memoryHeapCount; i++)
+        {
+            const VkMemoryHeap& heap = deviceCaps.memoryProperties.memoryHeaps[i];
+            cout << "\theap " << i << ": " << (heap.size >> 20) << " MiB" << ((heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) ? " device-local" : "") << endl;
+        }
+
+        for (uint32_t i = 0; i < deviceCaps.memoryProperties.memoryTypeCount; i++)
+        {
+            const VkMemoryType& type = deviceCaps.memoryProperties.memoryTypes[i];
+            cout << "\tmemory type " << i << ": heap " << type.heapIndex << ", flags 0x" << hex << type.propertyFlags << dec << endl;
+        }
+
+        for (uint32_t i = 0; i < deviceCaps.queueFamilies.size(); i++)
+        {
+            const VkQueueFamilyProperties& family = deviceCaps.queueFamilies[i];
+            cout << "\tqueue family " << i << ": " << family.queueCount << " queues, flags 0x" << hex << family.queueFlags << dec
+                 << ", timestamp bits " << family.timestampValidBits << endl;
+        }
+
+        cout << "\textensions: " << deviceCaps.extensions.size() << endl;
+    }
+
+    // 必須条件を満たさないデバイスは不適格とし、それ以外は性能に関わる要素を加点する
+    PhysicalDeviceRating ratePhyicalDevice(const DeviceCapabilities& caps)
+    {
+        const VkPhysicalDeviceProperties& properties = caps.properties;
+        const VkPhysicalDeviceMemoryProperties& memoryProperties = caps.memoryProperties;
+
+        PhysicalDeviceRating rating;
 
         // 必要なコマンドキュー族 必須
-        auto queueFamily = findQueueFamilyIndices(device);
+        const QueueFamilyIndices& queueFamily = caps.queueFamilyIndices;
         if (queueFamily.isComplete() == false)
-            return 0;
+        {
+            rating.reasons.push_back("missing graphics/present queue");
+            return rating;
+        }
 
         // 設備拡張　必須
-        if (!checkDeviceExtensionSupport(device))
-            return 0;
+        if (!checkDeviceExtensionSupport(caps.extensions))
+        {
+            rating.reasons.push_back("missing required device extensions");
+            return rating;
+        }
+
+        // スワップチェーンのサポート（formatsとpresentModes）は空であってはならない ヘッドレス時は表示しないため不要
+        if (!config.headless)
+        {
+            if (caps.surfaceFormats.empty() || caps.presentModes.empty())
+            {
+                rating.reasons.push_back("no surface formats or present modes");
+                return rating;
+            }
+        }
 
-        // スワップチェーンのサポート（formatsとpresentModes）は空であってはならない
-        auto swapChainSupport = getSupportedSwapChain(device);
+        rating.suitable = true;
 
-        if (swapChainSupport.formats.empty() || swapChainSupport.presentModes.empty())
+        // デバイスの種類 ディスクリートGPUは専用VRAMと帯域を持つため最優先
+        switch (properties.deviceType)
         {
-            return 0;
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+            rating.score += 1000;
+            rating.reasons.push_back("discrete +1000");
+            break;
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+            rating.score += 500;
+            rating.reasons.push_back("integrated +500");
+            break;
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+            rating.score += 250;
+            rating.reasons.push_back("virtual +250");
+            break;
+        case VK_PHYSICAL_DEVICE_TYPE_CPU:
+            rating.score += 10;
+            rating.reasons.push_back("cpu +10");
+            break;
+        default:
+            break;
+        }
+
+        // 最大のDEVICE_LOCALヒープのサイズ 1GiBごとに加点（統合GPUではシステムメモリの一部）
+        VkDeviceSize deviceLocalSize = 0;
+        for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++)
+        {
+            if (memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+                deviceLocalSize = std::max(deviceLocalSize, memoryProperties.memoryHeaps[i].size);
+        }
+        int heapScore = static_cast<int>(std::min<VkDeviceSize>(deviceLocalSize >> 30, 32)) * 25;
+        rating.score += heapScore;
+        rating.reasons.push_back(to_string(deviceLocalSize >> 20) + " MiB device-local +" + to_string(heapScore));
+
+        // 専用キュー族があれば、アップロードや非同期コンピュートを描画と並行できる
+        if (queueFamily.transferFamily >= 0)
+        {
+            rating.score += 100;
+            rating.reasons.push_back("dedicated transfer queue +100");
+        }
+        if (queueFamily.computeFamily >= 0)
+        {
+            rating.score += 50;
+            rating.reasons.push_back("dedicated compute queue +50");
+        }
+
+        // 利用できれば性能が向上する拡張
+        const pair<const char*, int> performanceExtensions[] =
+        {
+            { VK_EXT_MEMORY_BUDGET_EXTENSION_NAME, 25 },
+            { VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME, 25 },
+            { VK_EXT_INDEX_TYPE_UINT8_EXTENSION_NAME, 10 },
+        };
+        for (const auto& extension : performanceExtensions)
+        {
+            if (caps.hasExtension(extension.first))
+            {
+                rating.score += extension.second;
+                rating.reasons.push_back(string(extension.first) + " +" + to_string(extension.second));
+            }
         }
 
+        return rating;
     }
 
-    QueueFamilyIndices findQueueFamilyIndices(const VkPhysicalDevice& device)
+    // VkPhysicalDeviceIDPropertiesのdeviceUUID（Vulkan 1.1） 1.0のデバイスでは取得できないため空文字列
+    string getDeviceUUID(VkPhysicalDevice device, const VkPhysicalDeviceProperties& properties)
     {
-        uint32_t count = 0;
-        vkGetPhysicalDeviceQueueFamilyProperties(device, &count, nullptr);
-        vector<VkQueueFamilyProperties> properties(count);
-        vkGetPhysicalDeviceQueueFamilyProperties(device, &count, properties.data());
+        if (properties.apiVersion < VK_API_VERSION_1_1)
+            return "";
+
+        VkPhysicalDeviceIDProperties idProperties{};
+        idProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+
+        VkPhysicalDeviceProperties2 properties2{};
+        properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        properties2.pNext = &idProperties;
+        vkGetPhysicalDeviceProperties2(device, &properties2);
+
+        // 一般的なUUIDの表記 xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx
+        ostringstream uuid;
+        uuid << hex << setfill('0');
+        for (uint32_t i = 0; i < VK_UUID_SIZE; i++)
+        {
+            if (i == 4 || i == 6 || i == 8 || i == 10)
+                uuid << "-";
+            uuid << setw(2) << static_cast<uint32_t>(idProperties.deviceUUID[i]);
+        }
+        return uuid.str();
+    }
+
+    // overrideは列挙順のインデックス、UUID（ハイフン・大文字小文字は無視）、またはデバイス名の一部
+    bool matchesDeviceOverride(const DeviceCapabilities& caps, uint32_t index, const string& override)
+    {
+        if (all_of(override.begin(), override.end(), [](char c) { return isdigit(static_cast<unsigned char>(c)); }))
+            return stoul(override) == index;
+
+        auto normalizeUUID = [](string text)
+        {
+            text.erase(remove(text.begin(), text.end(), '-'), text.end());
+            transform(text.begin(), text.end(), text.begin(), [](char c) { return static_cast<char>(tolower(static_cast<unsigned char>(c))); });
+            return text;
+        };
+
+        if (!caps.deviceUUID.empty() && normalizeUUID(caps.deviceUUID) == normalizeUUID(override))
+            return true;
+
+        return string(caps.properties.deviceName).find(override) != string::npos;
+    }
 
+    QueueFamilyIndices findQueueFamilyIndices(VkPhysicalDevice device, const vector<VkQueueFamilyProperties>& properties)
+    {
         //  必要なキュー族の検出 
         QueueFamilyIndices indices;
         int i = 0;
         for (const auto& property : properties)
         {
-            if (property.queueCount > 0 && property.queueFlags & VK_QUEUE_GRAPHICS_BIT)
+            bool hasGraphics = (property.queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;
+            bool hasCompute = (property.queueFlags & VK_QUEUE_COMPUTE_BIT) != 0;
+            bool hasTransfer = (property.queueFlags & VK_QUEUE_TRANSFER_BIT) != 0;
+
+            if (property.queueCount > 0 && hasGraphics && indices.graphicsFamily < 0)
                 indices.graphicsFamily = i;
 
+            // ヘッドレス時は表示しないため、グラフィックスキューで代用する
             VkBool32 presentSupported = false;
-            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupported);
-            if (property.queueCount > 0 && presentSupported)
+            if (config.headless)
+                presentSupported = hasGraphics;
+            else
+                vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupported);
+            if (property.queueCount > 0 && presentSupported && indices.presentFamily < 0)
                 indices.presentFamily = i;
 
-            if (indices.isComplete())
-                break;
+            // TRANSFERのみのキュー族はDMAエンジンに対応し、描画と並行してコピーできる
+            // 転送・コンピュート族も探すため、必要なキュー族が揃っても途中で打ち切らない
+            if (property.queueCount > 0 && hasTransfer && !hasGraphics && !hasCompute && indices.transferFamily < 0)
+                indices.transferFamily = i;
+
+            if (property.queueCount > 0 && hasCompute && !hasGraphics && indices.computeFamily < 0)
+                indices.computeFamily = i;
 
             i++;
         }
@@ -590,13 +3662,21 @@ private:
 
     void createLogicalDevice()
     {
+        CpuScope cpuScope(cpuProfiler, __func__);
         // キュー族情報
-        QueueFamilyIndices indices = findQueueFamilyIndices(physicalDevice);
+        QueueFamilyIndices indices = deviceCaps.queueFamilyIndices;
 
         vector<VkDeviceQueueCreateInfo> queueInfos = {};
 
         // 赤黒木セットを使用すると重複要素を自動的に除外できます（例：graphicsQueueとprensentQueueが同一キュー族の場合、1つのキューのみ走査すれば良い）
         set<int> uniqueQueueFamilies = { indices.graphicsFamily, indices.presentFamily };
+        if (indices.transferFamily >= 0)
+            uniqueQueueFamilies.insert(indices.transferFamily);
+        if (indices.computeFamily >= 0)
+            uniqueQueueFamilies.insert(indices.computeFamily);
+
+        // pQueuePrioritiesはvkCreateDevice呼び出しまで有効である必要があるため、ループの外で宣言する
+        float queuePrirorty = 1.0f; // 単一のキューでも優先度の明示的指定が必須
 
         for (auto index : uniqueQueueFamilies)
         {
@@ -604,13 +3684,16 @@ private:
             queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
             queueInfo.queueFamilyIndex = index;
             queueInfo.queueCount = 1;  // キューの数。一般的に1つのキュー族で1つ以上のキューを使用することはない
-            float queuePrirorty = 1.0f; // 単一のキューでも優先度の明示的指定が必須
             queueInfo.pQueuePriorities = &queuePrirorty;
             queueInfos.push_back(queueInfo);
         }
 
         // デバイス機能
-        VkPhysicalDeviceFeatures deviceFeature = {}; // 後回しにする
+        VkPhysicalDeviceFeatures deviceFeature = {};
+        // 間接描画で複数のコマンドを1回で発行する（drawCount > 1）にはmultiDrawIndirect、
+        // コマンドのfirstInstanceを0以外にするにはdrawIndirectFirstInstanceが必要
+        deviceFeature.multiDrawIndirect = deviceCaps.features.multiDrawIndirect;
+        deviceFeature.drawIndirectFirstInstance = deviceCaps.features.drawIndirectFirstInstance;
 
         // 論理デバイスの作成
         VkDeviceCreateInfo createInfo = {};
@@ -618,8 +3701,24 @@ private:
         createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueInfos.size());
         createInfo.pQueueCreateInfos = queueInfos.data();
         createInfo.pEnabledFeatures = &deviceFeature;
-        createInfo.enabledExtensionCount = static_cast<uint32_t>(requiredDeviceExtension.size());
-        createInfo.ppEnabledExtensionNames = requiredDeviceExtension.data();
+
+        // 拡張の機能は拡張を有効にするだけでは使えず、機能構造体をpNextに繋いで有効化する
+        VkPhysicalDeviceIndexTypeUint8FeaturesEXT uint8Features{};
+        uint8Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_INDEX_TYPE_UINT8_FEATURES_EXT;
+        if (deviceCaps.indexTypeUint8)
+        {
+            uint8Features.indexTypeUint8 = VK_TRUE;
+            createInfo.pNext = &uint8Features;
+        }
+        vector<const char*> deviceExtensions = getRequiredDeviceExtensions();
+        for (const char* extension : getOptionalDeviceExtensions())
+        {
+            deviceExtensions.push_back(extension);
+        }
+        enabledDeviceExtensions = set<string>(deviceExtensions.begin(), deviceExtensions.end());
+        uint8IndicesEnabled = deviceCaps.indexTypeUint8;
+        createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
+        createInfo.ppEnabledExtensionNames = deviceExtensions.data();
 
         // インスタンスに設定した検証レイヤーは、そのまま論理デバイスにも適用可能
         if (enableValidationLayers)
@@ -637,12 +3736,54 @@ private:
             throw runtime_error("failed to create logical device!");
         }
 
+        if (isDeviceExtensionEnabled(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME))
+        {
+            cmdDrawIndexedIndirectCount = (PFN_vkCmdDrawIndexedIndirectCountKHR)vkGetDeviceProcAddr(device, "vkCmdDrawIndexedIndirectCountKHR");
+        }
+
         vkGetDeviceQueue(device, indices.graphicsFamily, 0, &graphicsQueue);
         vkGetDeviceQueue(device, indices.presentFamily, 0, &presentQueue);
+
+        transferQueue = graphicsQueue;
+        if (indices.transferFamily >= 0)
+            vkGetDeviceQueue(device, indices.transferFamily, 0, &transferQueue);
+
+        computeQueue = graphicsQueue;
+        if (indices.computeFamily >= 0)
+            vkGetDeviceQueue(device, indices.computeFamily, 0, &computeQueue);
+
+        cout << "Queue Families:" << endl;
+        cout << "\tgraphics: " << indices.graphicsFamily << endl;
+        cout << "\tpresent: " << indices.presentFamily << endl;
+        cout << "\ttransfer: " << indices.transferFamily << (indices.transferFamily < 0 ? " (graphics)" : "") << endl;
+        cout << "\tcompute: " << indices.computeFamily << (indices.computeFamily < 0 ? " (graphics)" : "") << endl;
+    }
+
+    void createMemoryAllocator()
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+        memoryAllocator.init(device, deviceCaps, isDeviceExtensionEnabled(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME));
+        memoryAllocator.printBudgets();
+
+        // ReBAR（VRAM全体をCPUから見えるようにする）や統合GPUでは、DEVICE_LOCALかつHOST_VISIBLEのメモリタイプがある
+        // その場合はCPUが最終バッファへ直接書き込めるため、ステージングバッファへのコピーと転送コマンドの提出が不要になる
+        directUploadMemoryType = findDirectUploadMemoryType(~0u);
+        if (!config.directUpload)
+            directUploadMemoryType = -1;
+
+        if (directUploadMemoryType >= 0)
+            cout << "Upload Path: direct write (memory type " << directUploadMemoryType << ")" << endl;
+        else
+            cout << "Upload Path: staging copy" << endl;
     }
 
     void createSurface()
     {
+        CpuScope cpuScope(cpuProfiler, __func__);
+        if (config.headless)
+            return;
+
+#ifdef _WIN32
         VkWin32SurfaceCreateInfoKHR createInfo = {};
         createInfo.sType = VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR;
         createInfo.hwnd = glfwGetWin32Window(window);
@@ -655,19 +3796,72 @@ private:
         {
             throw runtime_error("failed to create window surface!");
         }
+#else
+        // Win32以外ではプラットフォームごとのサーフェス作成をGLFWに任せる
+        if (glfwCreateWindowSurface(instance, window, nullptr, &surface) != VK_SUCCESS)
+        {
+            throw runtime_error("failed to create window surface!");
+        }
+#endif
+    }
+
+    // ヘッドレス時はスワップチェーンを使わないため、VK_KHR_swapchainも要求しない（ソフトウェアICDでも動作させるため）
+    vector<const char*> getRequiredDeviceExtensions()
+    {
+        if (config.headless)
+            return {};
+
+        return requiredDeviceExtension;
+    }
+
+    // サポートされていれば有効化する拡張 無くても動作する
+    vector<const char*> getOptionalDeviceExtensions()
+    {
+        vector<const char*> extensions;
+
+        // 予算の読み出しにはvkGetPhysicalDeviceMemoryProperties2（Vulkan 1.1）を使う
+        if (deviceCaps.hasExtension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) && deviceCaps.properties.apiVersion >= VK_API_VERSION_1_1)
+            extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
+        // 256頂点以下のメッシュのインデックスを1バイトにする
+        if (deviceCaps.indexTypeUint8)
+            extensions.push_back(VK_EXT_INDEX_TYPE_UINT8_EXTENSION_NAME);
+
+        // 描画数をGPU上のバッファから読む vkCmdDrawIndexedIndirectCountKHR（インスタンスがVulkan 1.1のため拡張として使う）
+        if (deviceCaps.hasExtension(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME))
+            extensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+
+        return extensions;
+    }
+
+    bool isDeviceExtensionEnabled(const char* name) const
+    {
+        return enabledDeviceExtensions.count(name) != 0;
     }
 
-    bool checkDeviceExtensionSupport(VkPhysicalDevice device)
+    set<string> getAvailableDeviceExtensions(VkPhysicalDevice device)
     {
         uint32_t extensionCount;
         vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
         vector<VkExtensionProperties> availableExtensions(extensionCount);
         vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
 
-        set<string> requiredExtensions(requiredDeviceExtension.begin(), requiredDeviceExtension.end());
+        set<string> extensionNames;
+        for (const auto& extension : availableExtensions)
+        {
+            extensionNames.insert(extension.extensionName);
+        }
+
+        return extensionNames;
+    }
+
+    bool checkDeviceExtensionSupport(const set<string>& availableExtensions)
+    {
+        vector<const char*> deviceExtensions = getRequiredDeviceExtensions();
+        set<string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
         for (const auto& extension : availableExtensions)
         {
-            requiredExtensions.erase(extension.extensionName);
+            requiredExtensions.erase(extension);
         }
 
         // 空でない場合、サポートされていないデバイス拡張が存在する
@@ -676,32 +3870,16 @@ private:
         return true;
     }
 
-    SwapChainSupportDetails getSupportedSwapChain(VkPhysicalDevice device)
+    SwapChainSupportDetails getSupportedSwapChain()
     {
         SwapChainSupportDetails details;
 
-        // capabilities
-        vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, surface, &details.capabilities);
-
-        // format
-        uint32_t formatCount;
-        vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &formatCount, nullptr);
-
-        if (formatCount != 0)
-        {
-            details.formats.resize(formatCount);
-            vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &formatCount, details.formats.data());
-        }
-
-        // presentMode
-        uint32_t presentModeCount;
-        vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface, &presentModeCount, nullptr);
+        // capabilities currentExtentはウィンドウサイズに応じて変わるため毎回取得する
+        vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physicalDevice, surface, &details.capabilities);
 
-        if (presentModeCount != 0)
-        {
-            details.presentModes.resize(presentModeCount);
-            vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface, &presentModeCount, details.presentModes.data());
-        }
+        // formatとpresentModeはデバイス選択時に取得済み
+        details.formats = deviceCaps.surfaceFormats;
+        details.presentModes = deviceCaps.presentModes;
 
         return details;
     }
@@ -749,27 +3927,63 @@ private:
     // PresentModeは垂直同期の仕組みを提供し、画面ティアリングを改善
     VkPresentModeKHR chooseSwapPresentMode(const vector<VkPresentModeKHR>& availablePresentModes)
     {
-        for (const auto& availablePresentMode : availablePresentModes)
+        vector<VkPresentModeKHR> preferredModes;
+        switch (config.presentPolicy)
+        {
+        case PresentPolicy::LowLatency:
+            preferredModes = { VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR };
+            break;
+        case PresentPolicy::FifoRelaxed:
+            preferredModes = { VK_PRESENT_MODE_FIFO_RELAXED_KHR };
+            break;
+        case PresentPolicy::PowerSaving:
+            break;
+        }
+
+        for (auto preferredMode : preferredModes)
         {
-            if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR)
+            if (find(availablePresentModes.begin(), availablePresentModes.end(), preferredMode) != availablePresentModes.end())
             {
-                return VK_PRESENT_MODE_MAILBOX_KHR;
+                return preferredMode;
             }
         }
 
-        return VK_PRESENT_MODE_FIFO_KHR;
+        return VK_PRESENT_MODE_FIFO_KHR; // サポートが必須
+    }
+
+    static const char* getPresentModeName(VkPresentModeKHR presentMode)
+    {
+        switch (presentMode)
+        {
+        case VK_PRESENT_MODE_IMMEDIATE_KHR: return "IMMEDIATE";
+        case VK_PRESENT_MODE_MAILBOX_KHR: return "MAILBOX";
+        case VK_PRESENT_MODE_FIFO_KHR: return "FIFO";
+        case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "FIFO_RELAXED";
+        default: return "UNKNOWN";
+        }
     }
 
     void createSwapChain()
     {
-        SwapChainSupportDetails swapChainSupport = getSupportedSwapChain(physicalDevice);
+        CpuScope cpuScope(cpuProfiler, __func__);
+        if (config.headless)
+        {
+            createOffscreenImages();
+            return;
+        }
+
+        SwapChainSupportDetails swapChainSupport = getSupportedSwapChain();
 
         VkSurfaceFormatKHR surfaceFormat = chooseSwapSurfaceFormat(swapChainSupport.formats);
         VkPresentModeKHR presentMode = chooseSwapPresentMode(swapChainSupport.presentModes);
         VkExtent2D extent = chooseSwapExtent(swapChainSupport.capabilities);
 
-        // バッファを1つ追加し、レンダリングブロッキングを低減
+        // 指定がなければバッファを1つ追加し、レンダリングブロッキングを低減
         uint32_t imageCount = swapChainSupport.capabilities.minImageCount + 1;
+        if (config.swapchainImages > 0)
+        {
+            imageCount = std::max(config.swapchainImages, swapChainSupport.capabilities.minImageCount);
+        }
         if (swapChainSupport.capabilities.maxImageCount > 0 && imageCount > swapChainSupport.capabilities.maxImageCount)
         {
             imageCount = swapChainSupport.capabilities.maxImageCount;
@@ -785,7 +3999,7 @@ private:
         createInfo.imageArrayLayers = 1; // VR関連、ここでは1に設定
         createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT; // カラーアタッチメントとして使用
 
-        QueueFamilyIndices indices = findQueueFamilyIndices(physicalDevice);
+        QueueFamilyIndices indices = deviceCaps.queueFamilyIndices;
         uint32_t queueFamilyIndices[] = { indices.graphicsFamily, indices.presentFamily };
 
         if (indices.graphicsFamily != indices.presentFamily)
@@ -807,8 +4021,8 @@ private:
         createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR; // ウィンドウ間のブレンド
         createInfo.presentMode = presentMode;
         createInfo.clipped = VK_TRUE; // Ⅴulkanには、他のウィンドウに隠れたピクセルを最適化可能
-        createInfo.oldSwapchain = VK_NULL_HANDLE; // スワップチェーンの再構築用、暫定VK_NULL_HANDLE
-                                                  // 再構築前のスワップチェーンを指定するとパフォーマンス向上
+        createInfo.oldSwapchain = swapChain; // 再構築前のスワップチェーンを指定するとパフォーマンス向上 初回はVK_NULL_HANDLE
+                                             // 古いスワップチェーンはretired状態になるが、破棄は呼び出し側が行う
 
 
         // スワップチェーン作成
@@ -817,16 +4031,62 @@ private:
             throw runtime_error("failed to create swap chain!");
         }
 
-        // スワップチェーンイメージ取得
+        uint32_t requestedImageCount = imageCount;
+
+        // スワップチェーンイメージ取得 ドライバは要求より多いイメージを作成する場合がある
         vkGetSwapchainImagesKHR(device, swapChain, &imageCount, nullptr);
         swapChainImages.resize(imageCount);
         vkGetSwapchainImagesKHR(device, swapChain, &imageCount, swapChainImages.data());
         swapChainImageFormat = surfaceFormat.format;
         swapChainExtent = extent;
+
+        cout << "Swap Chain: " << imageCount << " images (requested " << requestedImageCount << "), "
+             << config.framesInFlight << " frames in flight, present mode " << getPresentModeName(presentMode) << endl;
+    }
+
+    // スワップチェーンの代わりに描画先となるオフスクリーンイメージのリングを作成する
+    // 並列フレームごとに1枚持つことで、フェンス待機後はそのフレームのイメージをすぐに再利用できる
+    void createOffscreenImages()
+    {
+        swapChainImageFormat = VK_FORMAT_R8G8B8A8_UNORM; // ソフトウェアICDを含め、カラーアタッチメントとしてのサポートが必須のフォーマット
+        swapChainExtent = { WIDTH, HEIGHT };
+
+        swapChainImages.resize(config.framesInFlight);
+        offscreenImageMemory.resize(config.framesInFlight);
+
+        for (size_t i = 0; i < swapChainImages.size(); i++)
+        {
+            VkImageCreateInfo imageInfo{};
+            imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+            imageInfo.imageType = VK_IMAGE_TYPE_2D;
+            imageInfo.format = swapChainImageFormat;
+            imageInfo.extent = { swapChainExtent.width, swapChainExtent.height, 1 };
+            imageInfo.mipLevels = 1;
+            imageInfo.arrayLayers = 1;
+            imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+            imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+            imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT; // 結果を読み出せるようにTRANSFER_SRCも付ける
+            imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+            imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+            if (vkCreateImage(device, &imageInfo, nullptr, &swapChainImages[i]) != VK_SUCCESS)
+            {
+                throw runtime_error("failed to create offscreen image!");
+            }
+
+            VkMemoryRequirements memRequirements;
+            vkGetImageMemoryRequirements(device, swapChainImages[i], &memRequirements);
+
+            // OPTIMALイメージはバッファと同じブロックに置く場合bufferImageGranularityを考慮する必要がある
+            offscreenImageMemory[i] = allocateMemory(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+
+            vkBindImageMemory(device, swapChainImages[i], offscreenImageMemory[i].memory, offscreenImageMemory[i].offset);
+        }
     }
 
     void createImageViews()
     {
+        CpuScope cpuScope(cpuProfiler, __func__);
         swapChainImageViews.resize(swapChainImages.size());
 
         for (size_t i = 0; i < swapChainImages.size(); i++)
@@ -856,6 +4116,7 @@ private:
 
     void createRenderPass()
     {
+        CpuScope cpuScope(cpuProfiler, __func__);
         VkAttachmentDescription colorAttachment{};
         colorAttachment.format = swapChainImageFormat;
         colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
@@ -865,6 +4126,8 @@ private:
         colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
         colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED; // レンダリング前のレイアウトを考慮しない。画像内容が保持される保証はない。レンダリング前にクリアが必要な場合に適する
         colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR; // レンダリング後の画像はスワップチェーンで表示可能
+        if (config.headless)
+            colorAttachment.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL; // 表示しないため、読み出し用のレイアウトにする（PRESENT_SRCはVK_KHR_swapchainが必要）
 
         VkAttachmentReference colorAttachmentRef{};
         colorAttachmentRef.attachment = 0; // アタッチメントのインデックス
@@ -902,99 +4165,131 @@ private:
 
         if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass) != VK_SUCCESS)
         {
-            throw runtime_error("failed to create render pass!");
+            throw runtime_error("failed to create render pass!");
+        }
+    }
+
+    void createPipelineCache()
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+        vector<char> cacheData = loadPipelineCacheData();
+        pipelineCacheWarm = !cacheData.empty();
+
+        VkPipelineCacheCreateInfo cacheInfo{};
+        cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+        cacheInfo.initialDataSize = cacheData.size();
+        cacheInfo.pInitialData = cacheData.empty() ? nullptr : cacheData.data();
+
+        if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS)
+        {
+            throw runtime_error("failed to create pipeline cache!");
         }
     }
 
-    void createGraphicsPipeline()
+    // キャッシュファイルを読み込み、ヘッダが現在のデバイスと一致する場合のみデータを返す
+    // ドライバやGPUが変わるとキャッシュは使えないため、ヘッダで事前に弾く
+    vector<char> loadPipelineCacheData()
     {
-        auto vertShaderCode = readFile("shaders/vert.spv");
-        auto fragShaderCode = readFile("shaders/frag.spv");
+        ifstream file(PIPELINE_CACHE_FILE, ios::ate | ios::binary);
+        if (!file.is_open())
+        {
+            cout << "Pipeline cache: not found, starting cold" << endl;
+            return {};
+        }
 
-        VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
-        VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
+        size_t fileSize = (size_t)file.tellg();
+        vector<char> data(fileSize);
+        file.seekg(0);
+        file.read(data.data(), fileSize);
+        file.close();
 
-        VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
-        vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-        vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-        vertShaderStageInfo.module = vertShaderModule;
-        vertShaderStageInfo.pName = "main"; // 異なるpNameをエントリ関数名として指定することで、1つのコード内で複数のシェーダーを実装可能
+        VkPipelineCacheHeaderVersionOne header{};
+        if (data.size() < sizeof(header))
+        {
+            cout << "Pipeline cache: file too small, discarded" << endl;
+            return {};
+        }
+        memcpy(&header, data.data(), sizeof(header));
 
-        VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
-        fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-        fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-        fragShaderStageInfo.module = fragShaderModule;
-        fragShaderStageInfo.pName = "main";
+        const VkPhysicalDeviceProperties& properties = deviceCaps.properties;
 
-        VkPipelineShaderStageCreateInfo shaderStages[] = { vertShaderStageInfo, fragShaderStageInfo };
+        if (header.headerSize < sizeof(header) ||
+            header.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+            header.vendorID != properties.vendorID ||
+            header.deviceID != properties.deviceID ||
+            memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+        {
+            cout << "Pipeline cache: header mismatch (different device or driver), discarded" << endl;
+            return {};
+        }
 
-        // 頂点の解析設定
-        VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
-        vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+        cout << "Pipeline cache: loaded " << data.size() << " bytes" << endl;
+        return data;
+    }
 
-        auto bindingDescription = Vertex::getBindingDescription();
-        auto attributeDescriptions = Vertex::getAttributeDescriptions();
+    // 書き込み途中で終了しても壊れたキャッシュが残らないよう、一時ファイルに書いてから置き換える
+    void savePipelineCache()
+    {
+        size_t dataSize = 0;
+        if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr) != VK_SUCCESS || dataSize == 0)
+            return;
 
-        vertexInputInfo.vertexBindingDescriptionCount = 1; // 一つのBUFFERのみ
-        vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size()); 
-        vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
-        vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
+        vector<char> data(dataSize);
+        if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, data.data()) != VK_SUCCESS)
+            return;
 
-        // プリミティブのアセンブリ設定
-        VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
-        inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-        inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-        inputAssembly.primitiveRestartEnable = VK_FALSE;
+        string tempFile = PIPELINE_CACHE_FILE + ".tmp";
+        {
+            ofstream file(tempFile, ios::binary | ios::trunc);
+            if (!file.is_open())
+            {
+                cerr << "failed to write pipeline cache!" << endl;
+                return;
+            }
+            file.write(data.data(), dataSize);
+        }
 
-        // ビューポート設定
-        VkPipelineViewportStateCreateInfo viewportState{};
-        viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-        viewportState.viewportCount = 1;
-        viewportState.scissorCount = 1;
+        error_code ec;
+        filesystem::rename(tempFile, PIPELINE_CACHE_FILE, ec); // 既存ファイルを置き換える
+        if (ec)
+        {
+            cerr << "failed to replace pipeline cache: " << ec.message() << endl;
+            filesystem::remove(tempFile, ec);
+            return;
+        }
 
-        // ラスタライズ設定
-        VkPipelineRasterizationStateCreateInfo rasterizer{};
-        rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-        rasterizer.depthClampEnable = VK_FALSE;  // 視錐台外の部分をクリップせずクランプするか
-        rasterizer.rasterizerDiscardEnable = VK_FALSE; // ラスタライザの出力を破棄するか
-        rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
-        rasterizer.lineWidth = 1.0f;
-        rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-        rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
-        rasterizer.depthBiasEnable = VK_FALSE; //  シャドウマッピングのバイアスに関連
+        cout << "Pipeline cache: saved " << dataSize << " bytes" << endl;
+    }
 
-        // マルチサンプリング設定
-        VkPipelineMultisampleStateCreateInfo multisampling{};
-        multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-        multisampling.sampleShadingEnable = VK_FALSE;
-        multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    void createWorkerPool()
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+        // メインスレッドの分を1つ残す（hardware_concurrencyは取得できない場合0を返す）
+        uint32_t hardwareThreads = thread::hardware_concurrency();
+        uint32_t threadCount = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+        workerPool.init(threadCount);
+        recordWorkerPool.init(threadCount);
+
+        cout << "Worker threads: " << threadCount << " (compile) + " << threadCount << " (record)" << endl;
+    }
 
-        // ブレンド設定
-        VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-        colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-        colorBlendAttachment.blendEnable = VK_FALSE;
+    void createPipelineBuilder()
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+        pipelineBuilder.init(device, pipelineCache, &workerPool);
+    }
 
-        VkPipelineColorBlendStateCreateInfo colorBlending{};
-        colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-        colorBlending.logicOpEnable = VK_FALSE;  // 有効にするとグローバルブレンド設定になり、フレームバッファごとのブレンド設定が無効化
-        colorBlending.logicOp = VK_LOGIC_OP_COPY;
-        colorBlending.attachmentCount = 1;
-        colorBlending.pAttachments = &colorBlendAttachment;
-        colorBlending.blendConstants[0] = 0.0f;
-        colorBlending.blendConstants[1] = 0.0f;
-        colorBlending.blendConstants[2] = 0.0f;
-        colorBlending.blendConstants[3] = 0.0f;
+    void createGraphicsPipeline()
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+        auto vertShaderCode = readFile("shaders/vert.spv");
+        auto fragShaderCode = readFile("shaders/frag.spv");
 
-        // 動的に変更可能な機能の指定
-        vector<VkDynamicState> dynamicStates =
-        {
-            VK_DYNAMIC_STATE_VIEWPORT,
-            VK_DYNAMIC_STATE_SCISSOR
-        };
-        VkPipelineDynamicStateCreateInfo dynamicState{};
-        dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-        dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
-        dynamicState.pDynamicStates = dynamicStates.data();
+        VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
+        VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
+
+        // ModuleはPipelineの構築完了まで保持する必要がある（構築はワーカースレッドで非同期に行われる）
+        pendingShaderModules = { vertShaderModule, fragShaderModule };
 
         // uniform変数の設定
         VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
@@ -1007,31 +4302,61 @@ private:
             throw runtime_error("failed to create pipeline layout!");
         }
 
-        // pipelineを作成
-        VkGraphicsPipelineCreateInfo pipelineInfo{};
-        pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-        pipelineInfo.stageCount = 2;
-        pipelineInfo.pStages = shaderStages;
-        pipelineInfo.pVertexInputState = &vertexInputInfo;
-        pipelineInfo.pInputAssemblyState = &inputAssembly;
-        pipelineInfo.pViewportState = &viewportState;
-        pipelineInfo.pRasterizationState = &rasterizer;
-        pipelineInfo.pMultisampleState = &multisampling;
-        pipelineInfo.pColorBlendState = &colorBlending;
-        pipelineInfo.pDynamicState = &dynamicState;
-        pipelineInfo.layout = pipelineLayout;
-        pipelineInfo.renderPass = renderPass;
-        pipelineInfo.subpass = 0;
-        pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // 派生パイプラインを使用するかどうか。派生はコピーよりもパフォーマンスが良い
+        GraphicsPipelineDesc desc;
+        desc.vertShaderModule = vertShaderModule;
+        desc.fragShaderModule = fragShaderModule;
+
+        // 頂点の解析設定 バインディング0は頂点ごと、バインディング1はインスタンスごとに進む
+        auto attributeDescriptions = VertexLayout<Vertex>::getAttributeDescriptions(0);
+        auto instanceAttributeDescriptions = VertexLayout<InstanceData>::getAttributeDescriptions(1);
+        desc.bindingDescriptions = { VertexLayout<Vertex>::getBindingDescription(0), VertexLayout<InstanceData>::getBindingDescription(1, VK_VERTEX_INPUT_RATE_INSTANCE) };
+        desc.attributeDescriptions.assign(attributeDescriptions.begin(), attributeDescriptions.end());
+        desc.attributeDescriptions.insert(desc.attributeDescriptions.end(), instanceAttributeDescriptions.begin(), instanceAttributeDescriptions.end());
+        checkVertexFormatSupport(desc.attributeDescriptions.data(), static_cast<uint32_t>(desc.attributeDescriptions.size()));
+
+        desc.layout = pipelineLayout;
+        desc.renderPass = renderPass;
+        desc.subpass = 0;
+
+        // コンパイルはワーカースレッドで行い、完成するまでの間はパイプラインを使わずに描画する
+        graphicsPipelineFuture = pipelineBuilder.build(desc);
+    }
 
-        if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS)
+    // 圧縮フォーマットの頂点属性はオプションのものがある（A2B10G10R10_SNORMなど）ため、パイプライン作成前に確認する
+    void checkVertexFormatSupport(const VkVertexInputAttributeDescription* attributes, uint32_t count)
+    {
+        for (uint32_t i = 0; i < count; i++)
         {
-            throw runtime_error("failed to create graphics pipeline!");
+            const VkFormatProperties& formatProperties = deviceCaps.getFormatProperties(attributes[i].format);
+            if ((formatProperties.bufferFeatures & VK_FORMAT_FEATURE_VERTEX_BUFFER_BIT) == 0)
+            {
+                throw runtime_error("vertex format " + to_string(attributes[i].format) + " of location " + to_string(attributes[i].location) + " is not supported!");
+            }
         }
+    }
+
+    // 構築が完了していればパイプラインを取り出す（ブロックしない）
+    bool resolveGraphicsPipeline()
+    {
+        if (graphicsPipeline != VK_NULL_HANDLE)
+            return true;
+
+        if (!graphicsPipelineFuture.valid() || graphicsPipelineFuture.wait_for(chrono::seconds(0)) != future_status::ready)
+            return false;
+
+        PipelineBuildResult result = graphicsPipelineFuture.get(); // 構築時の例外はここで再送出される
+        graphicsPipeline = result.pipeline;
+
+        cout << "Graphics pipeline created in " << result.compileMs << " ms (" << (pipelineCacheWarm ? "warm" : "cold") << " start)" << endl;
 
         // ModuleはPipelineに管理させ、自身のメモリを解放する
-        vkDestroyShaderModule(device, fragShaderModule, nullptr);
-        vkDestroyShaderModule(device, vertShaderModule, nullptr);
+        for (auto shaderModule : pendingShaderModules)
+        {
+            vkDestroyShaderModule(device, shaderModule, nullptr);
+        }
+        pendingShaderModules.clear();
+
+        return true;
     }
 
     VkShaderModule createShaderModule(const vector<char>& code)
@@ -1076,6 +4401,7 @@ private:
 
     void createFramebuffers()
     {
+        CpuScope cpuScope(cpuProfiler, __func__);
         swapChainFramebuffers.resize(swapChainImageViews.size());
 
         for (size_t i = 0; i < swapChainImageViews.size(); i++)
@@ -1100,7 +4426,8 @@ private:
 
     void createCommandPool() 
     {
-        QueueFamilyIndices queueFamilyIndices = findQueueFamilyIndices(physicalDevice);
+        CpuScope cpuScope(cpuProfiler, __func__);
+        QueueFamilyIndices queueFamilyIndices = deviceCaps.queueFamilyIndices;
 
         VkCommandPoolCreateInfo poolInfo{};
         poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
@@ -1113,13 +4440,44 @@ private:
         }
     }
 
-    void createVertexBuffer() 
+    void createThreadCommandPools()
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+        QueueFamilyIndices queueFamilyIndices = deviceCaps.queueFamilyIndices;
+
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT; // 毎フレームプールごとリセットするため個別リセットは不要
+        poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily;
+
+        threadCommandPools.resize(config.framesInFlight);
+        for (auto& framePools : threadCommandPools)
+        {
+            framePools.resize(recordWorkerPool.getThreadCount());
+            for (auto& threadPool : framePools)
+            {
+                if (vkCreateCommandPool(device, &poolInfo, nullptr, &threadPool.pool) != VK_SUCCESS)
+                {
+                    throw runtime_error("failed to create thread command pool!");
+                }
+            }
+        }
+    }
+
+    void createUploadQueue()
     {
-        VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
+        CpuScope cpuScope(cpuProfiler, __func__);
+        QueueFamilyIndices queueFamilyIndices = deviceCaps.queueFamilyIndices;
 
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
+        // 転送専用キュー族があればそちらでコピーし、グラフィックスキューとの競合を避ける
+        uint32_t transferFamily = queueFamilyIndices.transferFamily >= 0 ? queueFamilyIndices.transferFamily : queueFamilyIndices.graphicsFamily;
 
+        uploadQueue.init(device, transferQueue, transferFamily, graphicsQueue, queueFamilyIndices.graphicsFamily);
+    }
+
+    void createStagingRing()
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
         // HOST_VISIBLE: CPUがこのメモリ（VRAM）にアクセス可能
         // HOST_COHERENT: CPUとGPUのメモリアクセスで自動的にキャッシュ一貫性（Cache Coherency）を維持
         // map -> copy -> unmap時、CPUとGPUのデータがキャッシュ原因で不一致になる可能性あり
@@ -1134,35 +4492,123 @@ private:
 
         // stagingBufferは一時的なCPU→GPUデータ転送用のため、VK_BUFFER_USAGE_VERTEX_BUFFER_BITは不要
         // VK_MEMORY_PROPERTY_HOST_VISIBLE_BITによりCPUから可視なメモリを確保（CPUからデータ書き込み可能）
-        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
+        createBuffer(STAGING_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                     stagingBuffer, stagingBufferMemory);
+                     stagingRingBuffer, stagingRingMemory);
+
+        // コピー元offsetはoptimalBufferCopyOffsetAlignmentに揃えると転送が速い
+        // アロケータが永続マップしているため、リングの寿命中にvkMapMemory/vkUnmapMemoryは一切呼ばない
+        stagingRing.init(stagingRingBuffer, stagingRingMemory.mappedData, STAGING_RING_SIZE, deviceCaps.properties.limits.optimalBufferCopyOffsetAlignment);
+    }
+
+    // 全メッシュをmeshArenaに登録し、1つのバッファに1回のコピーでアップロードする
+    void createMeshBuffer() 
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+        meshArena.setUint8IndicesEnabled(uint8IndicesEnabled);
+
+        vector<Vertex> meshVertices = vertices;
+        vector<uint32_t> meshIndices = indices;
+        if (config.meshOptimize)
+            optimizeMesh(meshVertices, meshIndices);
 
-        void* data;
-        vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-        memcpy(data, vertices.data(), (size_t)bufferSize);
-        vkUnmapMemory(device, stagingBufferMemory); // unmap時はキャッシュ一貫性に注意 HOST_COHERENT必要
+        meshArena.addMesh(meshVertices.data(), static_cast<uint32_t>(meshVertices.size()), meshIndices.data(), static_cast<uint32_t>(meshIndices.size()));
+        meshArena.printStats();
+
+        VkDeviceSize bufferSize = meshArena.getSize();
+
+        // 直接書き込めるメモリがあれば、最終的な配置のままバッファに書き込む（コピーも待つべきチケットも無い）
+        // vkQueueSubmitの前に行ったHOST_COHERENTメモリへの書き込みは、提出時にGPUから可視になる
+        if (tryCreateDirectUploadBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, meshBuffer, meshBufferMemory))
+        {
+            meshArena.write(meshBufferMemory.mappedData);
+            meshUploadTicket = UploadTicket{};
+            return;
+        }
 
-        // 実際のvertexBuffer（レンダリング用）のためVK_BUFFER_USAGE_VERTEX_BUFFER_BITを指定
+        // 頂点とインデックスの両方に使うためVK_BUFFER_USAGE_VERTEX_BUFFER_BITとVK_BUFFER_USAGE_INDEX_BUFFER_BITを指定
         // VK_MEMORY_PROPERTY_DEVICE_LOCAL_BITによりGPU専用メモリを確保（CPU可視メモリより高性能）
-        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory);
+        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, meshBuffer, meshBufferMemory);
+
+        vector<char> meshData(static_cast<size_t>(bufferSize));
+        meshArena.write(meshData.data());
+        meshUploadTicket = uploadBuffer(meshBuffer, meshData.data(), bufferSize);
+    }
+
+    // 三角形をキャッシュ効率の良い順に並べ替えた後、頂点をその参照順に並べ替える（描画結果は変わらない）
+    void optimizeMesh(vector<Vertex>& meshVertices, vector<uint32_t>& meshIndices)
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+        uint32_t vertexCount = static_cast<uint32_t>(meshVertices.size());
+        VertexCacheStats before = MeshOptimizer::analyzeVertexCache(meshIndices, vertexCount);
+
+        MeshOptimizer::optimizeVertexCache(meshIndices, vertexCount);
+
+        if (config.overdrawThreshold > 0.0f)
+        {
+            vector<vec3> positions(vertexCount);
+            for (uint32_t i = 0; i < vertexCount; i++)
+            {
+                positions[i] = vec3(unpackHalf2x16(meshVertices[i].pos.packed), 0.0f);
+            }
+
+            // 現在のメッシュは2D（z = 0）のため、オーバードロー最適化はスキップされる
+            if (!MeshOptimizer::optimizeOverdraw(meshIndices, positions, config.overdrawThreshold))
+                cout << "Mesh Optimizer: overdraw pass skipped (mesh has no depth extent)" << endl;
+        }
+
+        vertexCount = MeshOptimizer::optimizeVertexFetch(meshVertices, meshIndices);
+        VertexCacheStats after = MeshOptimizer::analyzeVertexCache(meshIndices, vertexCount);
+
+        cout << "Mesh Optimizer: " << meshIndices.size() / 3 << " triangles, " << vertexCount << " vertices" << endl;
+        cout << "\tACMR: " << before.acmr << " -> " << after.acmr << endl;
+        cout << "\tATVR: " << before.atvr << " -> " << after.atvr << endl;
+    }
+
+    // DEVICE_LOCAL | HOST_VISIBLEのメモリにバッファを作成する
+    // 直接書き込みが使えない場合や、そのヒープ（ReBAR無しでは256MB程度）の予算が足りない場合はfalseを返し、呼び出し側はステージング経由に切り替える
+    bool tryCreateDirectUploadBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer& buffer, MemoryAllocation& bufferMemory)
+    {
+        if (directUploadMemoryType < 0)
+            return false;
+
+        VkBufferCreateInfo bufferInfo{};
+        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferInfo.size = size;
+        bufferInfo.usage = usage;
+        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+        if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS)
+        {
+            throw runtime_error("failed to create buffer!");
+        }
+
+        VkMemoryRequirements memRequirements;
+        vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 
-        copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
+        int memoryTypeIndex = findDirectUploadMemoryType(memRequirements.memoryTypeBits);
+        if (memoryTypeIndex < 0 || !memoryAllocator.tryAllocate(memRequirements, static_cast<uint32_t>(memoryTypeIndex), true, bufferMemory))
+        {
+            vkDestroyBuffer(device, buffer, nullptr);
+            buffer = VK_NULL_HANDLE;
+            return false;
+        }
 
-        // 一時的なstagingBufferを削除
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
+        vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset);
+        return true;
     }
 
     void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, 
-                      VkBuffer& buffer, VkDeviceMemory& bufferMemory) 
+                      VkBuffer& buffer, MemoryAllocation& bufferMemory) 
     {
         VkBufferCreateInfo bufferInfo{};
         bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
         bufferInfo.size = size;
         bufferInfo.usage = usage;                            // バッファの用途指定
         bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;  // swapchainと同様、バッファもEXCLUSIVE/CONCURRENTを指定可能
-                                                             // 本バッファは1つのキュー（graphics queue）のみで使用するためEXCLUSIVEが適切
+                                                             // 転送キューとgraphics queueで使う場合もCONCURRENTにはせず、所有権の受け渡し（UploadQueue）で対応する
+                                                             // EXCLUSIVEの方がアクセス性能が良い
 
         if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) 
         {
@@ -1172,84 +4618,346 @@ private:
         VkMemoryRequirements memRequirements;
         vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 
-        VkMemoryAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = memRequirements.size;
-        //memoryTypeとpropertiesに対応するmemoryTypeIndexを検索
-        allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
+        // バッファごとにvkAllocateMemoryせず、アロケータのブロックから切り出す
+        bufferMemory = allocateMemory(memRequirements, properties, true);
+
+        // 同じVkDeviceMemory内の位置はoffsetで指定する（memRequirements.alignmentの倍数であること）
+        vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset);
+    }
+
+    // CPUのデータをステージングリング経由でDEVICE_LOCALのバッファに転送
+    // コピーはUploadQueueの現在のバッチに記録されるだけで、戻り値のチケットで完了を確認する
+    UploadTicket uploadBuffer(VkBuffer dstBuffer, const void* data, VkDeviceSize size)
+    {
+        stagingRing.retire(uploadQueue.getCompletedValue());
+
+        StagingRegion region;
+        while (!stagingRing.allocate(size, region))
+        {
+            if (!stagingRing.hasPending())
+            {
+                // リングより大きいデータのみ、一時的なステージングバッファを作成し完了を待って破棄する
+                VkBuffer stagingBuffer;
+                MemoryAllocation stagingBufferMemory;
+                createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+
+                memcpy(stagingBufferMemory.mappedData, data, (size_t)size);
+                UploadTicket ticket = uploadQueue.copyBuffer(stagingBuffer, 0, dstBuffer, 0, size);
+                uploadQueue.wait(ticket);
+
+                vkDestroyBuffer(device, stagingBuffer, nullptr);
+                memoryAllocator.release(stagingBufferMemory);
+                return ticket;
+            }
+
+            // リングが満杯なら、最も古いパーティションを使っている提出の完了を待って回収する
+            uploadQueue.wait({ stagingRing.getOldestPendingValue() });
+            stagingRing.retire(uploadQueue.getCompletedValue());
+        }
+
+        memcpy(region.data, data, (size_t)size); // HOST_COHERENTのためフラッシュ不要
+
+        UploadTicket ticket = uploadQueue.copyBuffer(region.buffer, region.offset, dstBuffer, 0, size);
+
+        // この領域を読むのはticketのバッチ。完了後にリングへ戻す
+        stagingRing.close(ticket.value);
+
+        return ticket;
+    }
+
+    void createDrawItems()
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+        drawItems.clear();
+        for (const DrawBatch& batch : instanceBatcher.getBatches())
+        {
+            const MeshRange& mesh = meshArena.getMeshes()[batch.mesh];
+
+            DrawItem item;
+            item.indexCount = mesh.indexCount;
+            item.firstIndex = mesh.firstIndex;
+            item.vertexOffset = mesh.vertexOffset;
+            item.indexType = mesh.indexType;
+            item.firstInstance = batch.firstInstance;
+            item.instanceCount = batch.instanceCount;
+            drawItems.push_back(item);
+        }
+
+        // 同じインデックス型の描画を連続させ、インデックスバッファのバインドと間接描画の呼び出しをインデックス型ごとに1回にする
+        stable_sort(drawItems.begin(), drawItems.end(), [](const DrawItem& a, const DrawItem& b) { return a.indexType < b.indexType; });
+
+        cout << "Instancing: " << sceneObjects.size() << " objects in " << drawItems.size() << " draws" << endl;
+    }
+
+    // drawItemsから間接描画コマンドとインデックス型ごとの描画数を作成し、1つのバッファにアップロードする
+    void createIndirectBuffer()
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+
+        // firstInstanceが0以外のコマンドはdrawIndirectFirstInstanceが無いと使えないため、その場合は直接描画のままにする
+        useIndirectDraws = config.indirectDraws && deviceCaps.features.drawIndirectFirstInstance && !drawItems.empty();
+        if (!useIndirectDraws)
+        {
+            cout << "Draw Path: direct (" << drawItems.size() << " vkCmdDrawIndexed)" << endl;
+            return;
+        }
+
+        vector<VkDrawIndexedIndirectCommand> commands(drawItems.size());
+        indirectGroups.clear();
+        for (uint32_t i = 0; i < drawItems.size(); i++)
+        {
+            const DrawItem& item = drawItems[i];
+            commands[i].indexCount = item.indexCount;
+            commands[i].instanceCount = item.instanceCount;
+            commands[i].firstIndex = item.firstIndex;
+            commands[i].vertexOffset = item.vertexOffset;
+            commands[i].firstInstance = item.firstInstance;
+
+            if (indirectGroups.empty() || indirectGroups.back().indexType != item.indexType)
+            {
+                IndirectDrawGroup group;
+                group.indexType = item.indexType;
+                group.firstCommand = i;
+                indirectGroups.push_back(group);
+            }
+            indirectGroups.back().commandCount++;
+        }
+
+        // コマンドは20バイトのため、描画数の配列は4バイト境界に揃う
+        // 描画数はGPUカリング導入までの仮の値（commandCountと同じ）で、gpuWrittenDrawCountsがfalseの間は読まれない
+        indirectCountOffset = sizeof(VkDrawIndexedIndirectCommand) * commands.size();
+        VkDeviceSize bufferSize = indirectCountOffset + sizeof(uint32_t) * indirectGroups.size();
+
+        vector<char> indirectData(static_cast<size_t>(bufferSize));
+        memcpy(indirectData.data(), commands.data(), static_cast<size_t>(indirectCountOffset));
+        for (size_t i = 0; i < indirectGroups.size(); i++)
+        {
+            memcpy(indirectData.data() + indirectCountOffset + i * sizeof(uint32_t), &indirectGroups[i].commandCount, sizeof(uint32_t));
+        }
+
+        if (tryCreateDirectUploadBuffer(bufferSize, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, indirectBuffer, indirectBufferMemory))
+        {
+            memcpy(indirectBufferMemory.mappedData, indirectData.data(), indirectData.size());
+            indirectUploadTicket = UploadTicket{};
+        }
+        else
+        {
+            createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indirectBuffer, indirectBufferMemory);
+            indirectUploadTicket = uploadBuffer(indirectBuffer, indirectData.data(), bufferSize);
+        }
+
+        const char* pathName = gpuWrittenDrawCounts && cmdDrawIndexedIndirectCount ? "vkCmdDrawIndexedIndirectCount" :
+                               deviceCaps.features.multiDrawIndirect ? "vkCmdDrawIndexedIndirect" : "vkCmdDrawIndexedIndirect (one command per call)";
+        cout << "Draw Path: indirect, " << commands.size() << " commands in " << indirectGroups.size() << " calls of " << pathName << endl;
+    }
+
+    // メッシュの各範囲をconfig.instanceCount個ずつ格子状に並べる
+    void createSceneObjects()
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+        uint32_t columns = static_cast<uint32_t>(ceil(sqrt(static_cast<double>(config.instanceCount))));
+        float cellSize = 2.0f / columns; // 正規化デバイス座標の幅は2
+
+        sceneObjects.clear();
+        for (uint32_t mesh = 0; mesh < meshArena.getMeshes().size(); mesh++)
+        {
+            for (uint32_t i = 0; i < config.instanceCount; i++)
+            {
+                SceneObject object;
+                object.mesh = mesh;
+                object.position = vec2(-1.0f + cellSize * (i % columns + 0.5f), -1.0f + cellSize * (i / columns + 0.5f));
+                object.scale = std::min(1.0f, cellSize * 0.9f);
+                sceneObjects.push_back(object);
+            }
+        }
+
+        instanceBatcher.build(sceneObjects);
+        sceneStartTime = chrono::steady_clock::now();
+    }
+
+    void createInstanceBuffers()
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+        instanceCapacity = static_cast<uint32_t>(sceneObjects.size());
+        animateInstances = sceneObjects.size() > 1;
+        instanceSliceCount = animateInstances ? config.framesInFlight : 1;
+        VkDeviceSize sliceSize = sizeof(InstanceData) * instanceCapacity;
+
+        createBuffer(sliceSize * instanceSliceCount, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, instanceBuffer, instanceBufferMemory);
+
+        if (!animateInstances)
+        {
+            // 毎フレーム変わらないため、メッシュと同じくステージングリング経由で1回だけ転送する
+            vector<InstanceData> instances(instanceCapacity);
+            writeInstanceData(instances.data(), 0.0f);
+            instanceUploadTicket = uploadBuffer(instanceBuffer, instances.data(), sliceSize);
+            return;
+        }
+
+        // 毎フレームの更新はステージングリングを使わず、並列フレームごとの固定領域に書き込む
+        // リングはアップロードキューの完了値で回収されるが、この領域はグラフィックスキューが読み、フレームのフェンスで再利用できるため
+        createBuffer(sliceSize * config.framesInFlight, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     instanceStagingBuffer, instanceStagingMemory);
+
+        instanceUpdateCommandBuffers.resize(config.framesInFlight);
+
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = static_cast<uint32_t>(instanceUpdateCommandBuffers.size());
+
+        if (vkAllocateCommandBuffers(device, &allocInfo, instanceUpdateCommandBuffers.data()) != VK_SUCCESS)
+        {
+            throw runtime_error("failed to allocate instance update command buffers!");
+        }
+    }
 
-        if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS) 
+    // 描画順（instanceBatcherの並び）のインスタンスデータをinstancesに書き込む
+    void writeInstanceData(InstanceData* instances, float time) const
+    {
+        const vector<uint32_t>& objectOrder = instanceBatcher.getObjectOrder();
+        for (uint32_t i = 0; i < objectOrder.size(); i++)
         {
-            throw runtime_error("failed to allocate buffer memory!");
+            const SceneObject& object = sceneObjects[objectOrder[i]];
+
+            // オブジェクトごとに位相をずらして明るさを揺らす（毎フレーム更新されていることの確認用）
+            float brightness = animateInstances ? 0.75f + 0.25f * sin(time * 2.0f + objectOrder[i] * 0.37f) : 1.0f;
+            vec3 color = object.color * brightness;
+
+            instances[i].transform = vec4(object.position, object.scale, object.scale);
+            instances[i].color = Unorm8x4(color.r, color.g, color.b);
+            instances[i].id = objectOrder[i];
         }
+    }
+
+    // frameIndexのフレームの描画がバインドするインスタンスバッファのスライス
+    uint32_t getInstanceSlice(uint32_t frameIndex) const
+    {
+        return frameIndex % instanceSliceCount;
+    }
 
-        vkBindBufferMemory(device, buffer, bufferMemory, 0);
+    VkDeviceSize getInstanceSliceOffset(uint32_t slice) const
+    {
+        return sizeof(InstanceData) * instanceCapacity * slice;
     }
 
-    // 理論上、index bufferはvertex bufferと同じbufferを共有でき（offsetで区別）、メモリの冗長性を削減可能
-    // ここでは簡略化のため2つのbufferに分離
-    void createIndexBuffer() 
+    // このフレームのインスタンスデータをステージング領域に書き込み、このフレームのスライスへのコピーを記録する
+    // 戻り値のコマンドバッファは描画のコマンドバッファより前に同じキューに提出する アニメーションしない場合はVK_NULL_HANDLE
+    VkCommandBuffer updateInstanceBuffer()
     {
-        VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
+        if (!animateInstances)
+            return VK_NULL_HANDLE;
+
+        float time = chrono::duration<float>(chrono::steady_clock::now() - sceneStartTime).count();
 
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+        VkDeviceSize sliceSize = getInstanceSliceOffset(1);
+        VkDeviceSize sliceOffset = getInstanceSliceOffset(getInstanceSlice(currentFrame));
+        writeInstanceData(reinterpret_cast<InstanceData*>(static_cast<char*>(instanceStagingMemory.mappedData) + sliceOffset), time);
 
-        void* data;
-        vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-        memcpy(data, indices.data(), (size_t)bufferSize);
-        vkUnmapMemory(device, stagingBufferMemory);
+        VkCommandBuffer commandBuffer = instanceUpdateCommandBuffers[currentFrame];
+        vkResetCommandBuffer(commandBuffer, 0);
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkBeginCommandBuffer(commandBuffer, &beginInfo);
 
-        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory);
+        gpuProfiler.beginFrame(commandBuffer, getInstanceUpdateProfilerSlot());
+        uint32_t copyScope = gpuProfiler.beginScope(commandBuffer, "InstanceUpdate");
 
-        copyBuffer(stagingBuffer, indexBuffer, bufferSize);
+        // このスライスを読んだ前回の提出はフェンスで完了済みのため、コピー前のバリアは要らない
+        VkBufferCopy copyRegion{};
+        copyRegion.srcOffset = sliceOffset;
+        copyRegion.dstOffset = sliceOffset;
+        copyRegion.size = sliceSize;
+        vkCmdCopyBuffer(commandBuffer, instanceStagingBuffer, instanceBuffer, 1, &copyRegion);
+
+        VkBufferMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.buffer = instanceBuffer;
+        barrier.offset = sliceOffset;
+        barrier.size = sliceSize;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+        gpuProfiler.endScope(commandBuffer, copyScope);
+
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+        {
+            throw runtime_error("failed to record instance update command buffer!");
+        }
 
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
+        return commandBuffer;
     }
 
-    // staging bufferからvertex bufferへのコピーはGPU内部で行われるため、vkCmdCopyBufferコマンドをキューに登録する必要がある
-    void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) 
+    // 記録済みのアップロードをまとめて提出（ロード時はN回の往復ではなく1回の提出になる）
+    void flushUploads()
     {
-        VkCommandBufferAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocInfo.commandPool = commandPool;
-        allocInfo.commandBufferCount = 1;
+        CpuScope cpuScope(cpuProfiler, __func__);
+        uploadQueue.flush();
+    }
 
-        VkCommandBuffer commandBuffer;
-        vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
+    // memoryTypeとpropertiesに対応するメモリタイプから確保する
+    // 予算内に収まらない場合、DEVICE_LOCALの要求は別ヒープのHOST_VISIBLEメモリへ逃がす（PCIe越しのアクセスで遅くなるが描画は続けられる）
+    // 逃がし先も無ければ、vkAllocateMemoryのメモリ不足ではなく予算超過として例外を投げる
+    MemoryAllocation allocateMemory(const VkMemoryRequirements& memRequirements, VkMemoryPropertyFlags properties, bool linear)
+    {
+        MemoryAllocation allocation;
+        uint32_t memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
+        if (memoryAllocator.tryAllocate(memRequirements, memoryTypeIndex, linear, allocation))
+            return allocation;
 
-        VkCommandBufferBeginInfo beginInfo{};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        // コピー後データはGPUに保存されるため、このコマンドバッファは1回使用後破棄。リソース節約になる
-        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT; 
+        uint32_t heapIndex = memoryAllocator.getHeapIndex(memoryTypeIndex);
+        if (properties & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+        {
+            VkMemoryPropertyFlags spillProperties = (properties & ~VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+            const VkPhysicalDeviceMemoryProperties& memProperties = deviceCaps.memoryProperties;
 
-        vkBeginCommandBuffer(commandBuffer, &beginInfo);
+            for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++)
+            {
+                if ((memRequirements.memoryTypeBits & (1 << i)) == 0 || memProperties.memoryTypes[i].heapIndex == heapIndex)
+                    continue;
+                if ((memProperties.memoryTypes[i].propertyFlags & spillProperties) != spillProperties)
+                    continue;
 
-        VkBufferCopy copyRegion{};
-        copyRegion.size = size;
-        vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+                if (memoryAllocator.tryAllocate(memRequirements, i, linear, allocation))
+                {
+                    cout << "Memory Budget: heap " << heapIndex << " is full, spilled " << memRequirements.size
+                         << " bytes to heap " << memProperties.memoryTypes[i].heapIndex << " (memory type " << i << ")" << endl;
+                    return allocation;
+                }
+            }
+        }
 
-        vkEndCommandBuffer(commandBuffer);
+        memoryAllocator.printBudgets();
+        throw runtime_error("memory budget of heap " + to_string(heapIndex) + " exhausted, failed to allocate " + to_string(memRequirements.size) + " bytes!");
+    }
 
-        VkSubmitInfo submitInfo{};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffer; 
+    // DEVICE_LOCAL | HOST_VISIBLE | HOST_COHERENTのメモリタイプを探す 無ければ-1
+    // HOST_COHERENTに限定することで、書き込み後のvkFlushMappedMemoryRangesを不要にする
+    int findDirectUploadMemoryType(uint32_t typeFilter)
+    {
+        const VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+        const VkPhysicalDeviceMemoryProperties& memProperties = deviceCaps.memoryProperties;
 
-        // vkCmdCopyBufferにはVK_QUEUE_TRANSFER_BITが必要だが、VK_QUEUE_GRAPHICS_BITはVK_QUEUE_TRANSFER_BITを含む
-        vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-        vkQueueWaitIdle(graphicsQueue); // 1回限りのコマンドなので、簡易的な同期機構vkQueueWaitIdleでも問題ない
+        for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++)
+        {
+            if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties)
+            {
+                return static_cast<int>(i);
+            }
+        }
 
-        vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+        return -1;
     }
 
     uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) 
     {
-        VkPhysicalDeviceMemoryProperties memProperties;
-        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+        const VkPhysicalDeviceMemoryProperties& memProperties = deviceCaps.memoryProperties;
 
         for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) 
         {
@@ -1264,7 +4972,8 @@ private:
 
     void createCommandBuffers() 
     {
-        commandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+        CpuScope cpuScope(cpuProfiler, __func__);
+        commandBuffers.resize(config.framesInFlight);
 
         VkCommandBufferAllocateInfo allocInfo{};
         allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -1278,8 +4987,66 @@ private:
         }
     }
 
+    void createSwapChainCommandBuffers()
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+        // インスタンスバッファのスライスはフレームごとに異なるため、イメージとスライスの組ごとに記録する
+        swapChainCommandBuffers.resize(swapChainFramebuffers.size() * instanceSliceCount);
+
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = (uint32_t)swapChainCommandBuffers.size();
+
+        if (vkAllocateCommandBuffers(device, &allocInfo, swapChainCommandBuffers.data()) != VK_SUCCESS)
+        {
+            throw runtime_error("failed to allocate swap chain command buffers!");
+        }
+
+        // 記録は初めて使う時に行う
+        swapChainCommandBufferDirty.assign(swapChainCommandBuffers.size(), true);
+        imagesInFlight.assign(swapChainFramebuffers.size(), VK_NULL_HANDLE);
+    }
+
+    // このフレームでimageIndexに描画する事前記録済みコマンドバッファのインデックス
+    size_t getSwapChainCommandBufferIndex(uint32_t imageIndex) const
+    {
+        return static_cast<size_t>(imageIndex) * instanceSliceCount + getInstanceSlice(currentFrame);
+    }
+
+    // 同じイメージのコマンドバッファを別のフレームがまだ使用中なら、記録・提出の前に完了を待つ
+    // このフレームのフェンスをリセットする前に呼ぶこと（リセット後に自身のフェンスを待つと永久に返らない）
+    void waitForImageInFlight(uint32_t imageIndex)
+    {
+        // 前回このイメージを使ったのが同じフレームなら、drawFrame冒頭のフェンス待ちで完了済み
+        if (imagesInFlight[imageIndex] != VK_NULL_HANDLE && imagesInFlight[imageIndex] != inFlightFences[currentFrame])
+        {
+            vkWaitForFences(device, 1, &imagesInFlight[imageIndex], VK_TRUE, UINT64_MAX);
+        }
+        imagesInFlight[imageIndex] = inFlightFences[currentFrame];
+    }
+
+    // 事前記録モードでは、このイメージ用のコマンドバッファを返す（必要な場合のみ記録し直す）
+    // waitForImageInFlightで前回の提出の完了を待った後に呼ぶ
+    VkCommandBuffer acquireSwapChainCommandBuffer(uint32_t imageIndex)
+    {
+        // 待機済みのため、このイメージのコマンドバッファの前回の計測結果は読み出せる
+        gpuProfiler.collect(getProfilerSlot(imageIndex));
+
+        size_t bufferIndex = getSwapChainCommandBufferIndex(imageIndex);
+        if (swapChainCommandBufferDirty[bufferIndex])
+        {
+            // パイプラインが未完成でクリアのみ記録した場合はdirtyのまま残し、完成後に記録し直す
+            swapChainCommandBufferDirty[bufferIndex] = !recordCommandBuffer(swapChainCommandBuffers[bufferIndex], imageIndex);
+        }
+
+        return swapChainCommandBuffers[bufferIndex];
+    }
+
     // コマンドバッファへの命令記録
-    void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) 
+    // シーン全体を記録できた場合はtrue、パイプライン未完成で描画をスキップした場合はfalseを返す
+    bool recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) 
     {
         VkCommandBufferBeginInfo beginInfo{};
         beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -1301,8 +5068,142 @@ private:
         renderPassInfo.clearValueCount = 1;
         renderPassInfo.pClearValues = &clearColor;
 
-        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        // パイプラインの構築が完了するまではクリアのみ行い、描画はスキップする
+        bool pipelineReady = resolveGraphicsPipeline();
+
+        // レンダーパス全体のGPU時間を計測する（クエリのリセットとタイムスタンプはレンダーパスの外で記録する）
+        gpuProfiler.beginFrame(commandBuffer, getProfilerSlot(imageIndex));
+        uint32_t renderPassScope = gpuProfiler.beginScope(commandBuffer, "RenderPass");
+
+        if (pipelineReady && config.recordMode == CommandRecordMode::Secondary)
+        {
+            // セカンダリの記録をワーカースレッドに投げてから、プライマリのレンダーパスを開始する
+            auto secondaryFutures = recordSecondaryCommandBuffers(imageIndex);
+
+            // レンダーパス内のコマンドは全てセカンダリから実行する（インラインのコマンドとは混在できない）
+            vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+            vector<VkCommandBuffer> secondaryBuffers;
+            for (auto& secondaryFuture : secondaryFutures)
+            {
+                secondaryBuffers.push_back(secondaryFuture.get()); // 提出順を保つため分割順に取り出す
+            }
+
+            vkCmdExecuteCommands(commandBuffer, static_cast<uint32_t>(secondaryBuffers.size()), secondaryBuffers.data());
+        }
+        else
+        {
+            vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+            if (pipelineReady)
+            {
+                recordDrawCommands(commandBuffer, getInstanceSlice(currentFrame), 0, drawItems.size());
+            }
+        }
+
+        vkCmdEndRenderPass(commandBuffer);
+
+        gpuProfiler.endScope(commandBuffer, renderPassScope);
+
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) 
+        {
+            throw runtime_error("failed to record command buffer!");
+        }
+
+        return pipelineReady;
+    }
+
+    // drawItemsをワーカースレッド数に応じて分割し、それぞれセカンダリコマンドバッファに記録する
+    vector<future<VkCommandBuffer>> recordSecondaryCommandBuffers(uint32_t imageIndex)
+    {
+        // このフレームのフェンスは待機済みのため、このフレーム用のプールはGPUで使用されていない
+        for (auto& threadPool : threadCommandPools[currentFrame])
+        {
+            vkResetCommandPool(device, threadPool.pool, 0);
+            threadPool.usedCount = 0;
+        }
+
+        size_t drawCount = drawItems.size();
+        size_t jobCount = std::min<size_t>(recordWorkerPool.getThreadCount(), (drawCount + MIN_DRAWS_PER_RECORD_JOB - 1) / MIN_DRAWS_PER_RECORD_JOB);
+        jobCount = std::max<size_t>(jobCount, 1);
+        size_t drawsPerJob = (drawCount + jobCount - 1) / jobCount;
+
+        vector<future<VkCommandBuffer>> futures;
+        for (size_t first = 0; first < drawCount || futures.empty(); first += drawsPerJob)
+        {
+            size_t count = std::min(drawsPerJob, drawCount - first);
+            uint32_t frameIndex = currentFrame;
+            uint32_t instanceSlice = getInstanceSlice(currentFrame);
+            string scopeName = "Secondary" + to_string(futures.size()); // 分割ごとのGPU時間
+
+            futures.push_back(recordWorkerPool.submit([this, frameIndex, imageIndex, instanceSlice, scopeName, first, count](uint32_t workerIndex)
+            {
+                return recordSecondaryCommandBuffer(threadCommandPools[frameIndex][workerIndex], imageIndex, instanceSlice, scopeName, first, count);
+            }));
+        }
+
+        return futures;
+    }
+
+    // ワーカースレッドで実行される。workerIndexのプールは他のスレッドから触れられない
+    VkCommandBuffer recordSecondaryCommandBuffer(ThreadCommandPool& threadPool, uint32_t imageIndex, uint32_t instanceSlice, const string& scopeName, size_t firstItem, size_t itemCount)
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+
+        if (threadPool.usedCount == threadPool.secondaryBuffers.size())
+        {
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = threadPool.pool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY; // プライマリからvkCmdExecuteCommandsで実行される
+            allocInfo.commandBufferCount = 1;
+
+            VkCommandBuffer secondaryBuffer;
+            if (vkAllocateCommandBuffers(device, &allocInfo, &secondaryBuffer) != VK_SUCCESS)
+            {
+                throw runtime_error("failed to allocate secondary command buffer!");
+            }
+            threadPool.secondaryBuffers.push_back(secondaryBuffer);
+        }
+
+        VkCommandBuffer commandBuffer = threadPool.secondaryBuffers[threadPool.usedCount++];
+
+        // セカンダリはどのレンダーパス・サブパス・フレームバッファの中で実行されるかを継承情報で指定する
+        VkCommandBufferInheritanceInfo inheritanceInfo{};
+        inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        inheritanceInfo.renderPass = renderPass;
+        inheritanceInfo.subpass = 0;
+        inheritanceInfo.framebuffer = swapChainFramebuffers[imageIndex]; // 省略可能だが、指定するとドライバが最適化できる
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
+        {
+            throw runtime_error("failed to begin recording secondary command buffer!");
+        }
+
+        // タイムスタンプはレンダーパス内のセカンダリにも書き込める（クエリのリセットはプライマリの記録開始時に済んでいる）
+        uint32_t scope = gpuProfiler.beginScope(commandBuffer, scopeName);
+
+        // パイプラインや動的ステートはプライマリから継承されないため、セカンダリごとに設定する
+        recordDrawCommands(commandBuffer, instanceSlice, firstItem, itemCount);
+
+        gpuProfiler.endScope(commandBuffer, scope);
+
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+        {
+            throw runtime_error("failed to record secondary command buffer!");
+        }
+
+        return commandBuffer;
+    }
 
+    // drawItems[firstItem, firstItem + itemCount)を記録 インスタンスデータはinstanceSliceのスライスを読む
+    void recordDrawCommands(VkCommandBuffer commandBuffer, uint32_t instanceSlice, size_t firstItem, size_t itemCount)
+    {
         vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
 
         VkViewport viewport{};
@@ -1319,27 +5220,82 @@ private:
         scissor.extent = swapChainExtent;
         vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 
-        VkBuffer vertexBuffers[] = { vertexBuffer };
-        VkDeviceSize offsets[] = { 0 };
-        vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+        // 全メッシュが同じバッファにあるため、バインドは1回だけ 各描画はfirstIndex/vertexOffsetで区別する
+        // インスタンスバッファも同様にスライスを1回だけバインドし、各描画はfirstInstanceで区別する
+        VkBuffer vertexBuffers[] = { meshBuffer, instanceBuffer };
+        VkDeviceSize offsets[] = { meshArena.getVertexOffset(), getInstanceSliceOffset(instanceSlice) };
+        vkCmdBindVertexBuffers(commandBuffer, 0, 2, vertexBuffers, offsets);
 
-        vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT16);
+        // drawItemsはインデックス型ごとに連続しているため、型が変わる時だけインデックスバッファをバインドし直す
+        size_t endItem = firstItem + itemCount;
+        for (size_t runStart = firstItem; runStart < endItem;)
+        {
+            VkIndexType indexType = drawItems[runStart].indexType;
+            size_t runEnd = runStart;
+            while (runEnd < endItem && drawItems[runEnd].indexType == indexType)
+                runEnd++;
 
-        vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(indices.size()), 1, 0, 0, 0);
+            vkCmdBindIndexBuffer(commandBuffer, meshBuffer, meshArena.getIndexOffset(indexType), indexType);
 
-        vkCmdEndRenderPass(commandBuffer);
+            if (useIndirectDraws)
+            {
+                recordIndirectDraws(commandBuffer, static_cast<uint32_t>(runStart), static_cast<uint32_t>(runEnd - runStart));
+            }
+            else
+            {
+                for (size_t i = runStart; i < runEnd; i++)
+                {
+                    const DrawItem& item = drawItems[i];
+                    vkCmdDrawIndexed(commandBuffer, item.indexCount, item.instanceCount, item.firstIndex, item.vertexOffset, item.firstInstance);
+                }
+            }
 
-        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) 
+            runStart = runEnd;
+        }
+    }
+
+    // 同じインデックス型の間接描画コマンド[firstCommand, firstCommand + commandCount)を発行する
+    void recordIndirectDraws(VkCommandBuffer commandBuffer, uint32_t firstCommand, uint32_t commandCount)
+    {
+        const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+        VkDeviceSize offset = static_cast<VkDeviceSize>(firstCommand) * stride;
+
+        if (gpuWrittenDrawCounts && cmdDrawIndexedIndirectCount)
         {
-            throw runtime_error("failed to record command buffer!");
+            // 下準備: GPUカリングが描画数を書き込むようになるまでは通らない
+            // 描画数はバッファ内のグループの値を使い、maxDrawCountで範囲を制限する
+            // セカンダリ記録でグループが分割された場合も、各範囲はmin(描画数, commandCount)個を描画する
+            uint32_t groupIndex = 0;
+            while (groupIndex + 1 < indirectGroups.size() && indirectGroups[groupIndex + 1].firstCommand <= firstCommand)
+                groupIndex++;
+
+            cmdDrawIndexedIndirectCount(commandBuffer, indirectBuffer, offset, indirectBuffer, indirectCountOffset + groupIndex * sizeof(uint32_t), commandCount, stride);
+        }
+        else if (deviceCaps.features.multiDrawIndirect)
+        {
+            vkCmdDrawIndexedIndirect(commandBuffer, indirectBuffer, offset, commandCount, stride);
+        }
+        else
+        {
+            // multiDrawIndirectが無い場合、drawCountは0か1に限られる
+            for (uint32_t i = 0; i < commandCount; i++)
+            {
+                vkCmdDrawIndexedIndirect(commandBuffer, indirectBuffer, offset + static_cast<VkDeviceSize>(i) * stride, 1, stride);
+            }
         }
     }
 
     void createSyncObjects() 
     {
-        imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+        CpuScope cpuScope(cpuProfiler, __func__);
+        // ヘッドレス時はイメージ取得も表示もないため、セマフォは作らない
+        if (!config.headless)
+        {
+            imageAvailableSemaphores.resize(config.framesInFlight);
+            renderFinishedSemaphores.resize(config.framesInFlight);
+        }
+        inFlightFences.resize(config.framesInFlight);
+        frameSubmitCounts.assign(config.framesInFlight, 0);
 
         VkSemaphoreCreateInfo semaphoreInfo{};
         semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
@@ -1348,11 +5304,15 @@ private:
         fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
         fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT; // 初期状態での無限待機を防止するため
 
-        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) 
+        for (size_t i = 0; i < config.framesInFlight; i++) 
         {
-            if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
-                vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS ||
-                vkCreateFence(device, &fenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS) 
+            if (!config.headless &&
+                (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
+                 vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS))
+            {
+                throw runtime_error("failed to create synchronization objects for a frame!");
+            }
+            if (vkCreateFence(device, &fenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS) 
             {
                 throw runtime_error("failed to create synchronization objects for a frame!");
             }
@@ -1360,14 +5320,55 @@ private:
 
     }
 
+    void createGpuProfiler()
+    {
+        CpuScope cpuScope(cpuProfiler, __func__);
+        QueueFamilyIndices queueFamilyIndices = deviceCaps.queueFamilyIndices;
+
+        // 先頭の並列フレーム数分はインスタンス更新用、その後ろが描画のコマンドバッファ用
+        uint32_t slotCount = config.framesInFlight + std::max<uint32_t>(config.framesInFlight, static_cast<uint32_t>(swapChainImages.size()));
+        gpuProfiler.init(device, deviceCaps, queueFamilyIndices.graphicsFamily, slotCount);
+    }
+
+    // 描画のコマンドバッファに対応するGpuProfilerのスロット
+    // スワップチェーン再作成でイメージが増えた場合はスロット数を超え、計測されない
+    uint32_t getProfilerSlot(uint32_t imageIndex) const
+    {
+        return config.framesInFlight + (config.recordMode == CommandRecordMode::PreRecorded ? imageIndex : currentFrame);
+    }
+
+    // インスタンス更新のコマンドバッファに対応するGpuProfilerのスロット
+    uint32_t getInstanceUpdateProfilerSlot() const
+    {
+        return currentFrame;
+    }
+
     void drawFrame() 
     {
+        CpuScope frameScope(cpuProfiler, "drawFrame");
+
         // CPUとGPU間の同期、前のフレームのレンダリングが完了するのを待ってから現在のフレームをレンダリング
+        CpuScope fenceScope(cpuProfiler, "WaitForFence");
         vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+        lastFenceWaitMs = fenceScope.end() / 1000.0;
+
+        // このフレームが完了した時点で、それ以前に提出したフレームも全て完了している
+        completedFrameCount = std::max(completedFrameCount, frameSubmitCounts[currentFrame]);
+        destroyRetiredSwapChains();
+
+        // このフレームのコマンドバッファを記録し直す前に、前回のGPU計測結果を回収する
+        if (config.recordMode != CommandRecordMode::PreRecorded)
+            gpuProfiler.collect(getProfilerSlot(0));
+        gpuProfiler.collect(getInstanceUpdateProfilerSlot());
 
         // スワップチェーンから次のレンダリング対象イメージを取得（現在は1つのみ）、イメージ取得に成功するとimageAvailableSemaphoreシグナルが発行される
-        uint32_t imageIndex;
-        VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+        // ヘッドレス時はオフスクリーンイメージを並列フレームごとに1枚持つため、取得を待つ必要はない
+        uint32_t imageIndex = currentFrame;
+        VkResult result = VK_SUCCESS;
+        CpuScope acquireScope(cpuProfiler, "AcquireNextImage");
+        if (!config.headless)
+            result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+        lastAcquireWaitMs = acquireScope.end() / 1000.0;
 
         // ウィンドウサイズ変更後は通常VK_ERROR_OUT_OF_DATE_KHRエラーが発生し、スワップチェーン再構築が必要
         if (result == VK_ERROR_OUT_OF_DATE_KHR) 
@@ -1380,39 +5381,87 @@ private:
             throw runtime_error("failed to acquire swap chain image!");
         }
 
+        // 事前記録モードでは、イメージごとのコマンドバッファを前回提出したフレームの完了も待つ
+        // ヘッドレス時はオフスクリーンイメージが並列フレームと1対1のため、上のフェンス待ちだけで排他が保証される
+        // この待機もフェンスでブロックされた時間としてフレーム統計に含める
+        if (config.recordMode == CommandRecordMode::PreRecorded && !config.headless)
+        {
+            CpuScope imageFenceScope(cpuProfiler, "WaitForImageFence");
+            waitForImageInFlight(imageIndex);
+            lastFenceWaitMs += imageFenceScope.end() / 1000.0;
+        }
+
         // 次の同期のために手動でunsignaled状態にリセットする必要がある
         // vkResetFencesはif (result == VK_ERROR_OUT_OF_DATE_KHR) 分岐後に配置すること
         // そうしないとレンダリングコマンド未提交により、GPUを待つことが永久化する
         vkResetFences(device, 1, &inFlightFences[currentFrame]); 
 
 
-        // CommandBufferにコマンドを書き込む
-        vkResetCommandBuffer(commandBuffers[currentFrame], /*VkCommandBufferResetFlagBits*/ 0);
-        recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+        // メッシュバッファを初めて使う時点でのみアップロード完了を待つ（完了済みなら即座に返る）
+        CpuScope uploadScope(cpuProfiler, "WaitForUpload");
+        uploadQueue.wait(meshUploadTicket);
+        uploadQueue.wait(indirectUploadTicket);
+        uploadQueue.wait(instanceUploadTicket);
+        uploadScope.end();
+
+        CpuScope recordScope(cpuProfiler, "Record");
+        VkCommandBuffer commandBuffer;
+        if (config.recordMode == CommandRecordMode::PreRecorded)
+        {
+            // 事前記録済みのコマンドバッファをそのまま提出（CPUの記録コストなし）
+            commandBuffer = acquireSwapChainCommandBuffer(imageIndex);
+        }
+        else
+        {
+            // CommandBufferにコマンドを書き込む
+            commandBuffer = commandBuffers[currentFrame];
+            vkResetCommandBuffer(commandBuffer, /*VkCommandBufferResetFlagBits*/ 0);
+            recordCommandBuffer(commandBuffer, imageIndex);
+        }
+        recordScope.end();
+
+        // インスタンスの更新は描画より前に実行されるよう、同じ提出の先頭に置く
+        CpuScope instanceScope(cpuProfiler, "UpdateInstances");
+        VkCommandBuffer instanceUpdateCommandBuffer = updateInstanceBuffer();
+        VkCommandBuffer submitCommandBuffers[] = { instanceUpdateCommandBuffer, commandBuffer };
+        uint32_t firstSubmitBuffer = instanceUpdateCommandBuffer == VK_NULL_HANDLE ? 1 : 0; // 更新が無ければ描画のみ提出
+        instanceScope.end();
 
         // コマンドキューの送信情報
         VkSubmitInfo submitInfo{};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
         // レンダリングコマンドはimageAvailableSemaphoreの解放を待つ必要がある、つまりスワップチェーンがレンダリング対象イメージを取得するのを待つ
-        VkSemaphore waitSemaphores[] = { imageAvailableSemaphores[currentFrame] };
+        VkSemaphore waitSemaphores[] = { config.headless ? VK_NULL_HANDLE : imageAvailableSemaphores[currentFrame] };
         // カラーアタッチメント出力ステージでのみ待機が必要で、それ以前の作業は先に完了できる
         VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT }; 
-        submitInfo.waitSemaphoreCount = 1;
+        submitInfo.waitSemaphoreCount = config.headless ? 0 : 1; // ヘッドレス時はイメージ取得も表示もないため、セマフォは使わない
         submitInfo.pWaitSemaphores = waitSemaphores;
         submitInfo.pWaitDstStageMask = waitStages;
 
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
+        submitInfo.commandBufferCount = 2 - firstSubmitBuffer;
+        submitInfo.pCommandBuffers = submitCommandBuffers + firstSubmitBuffer;
 
         // レンダリングコマンドが完了すると、renderFinishedSemaphoreが発行され、レンダリング完了を示す
-        VkSemaphore signalSemaphores[] = { renderFinishedSemaphores[currentFrame] };
-        submitInfo.signalSemaphoreCount = 1;
+        VkSemaphore signalSemaphores[] = { config.headless ? VK_NULL_HANDLE : renderFinishedSemaphores[currentFrame] };
+        submitInfo.signalSemaphoreCount = config.headless ? 0 : 1;
         submitInfo.pSignalSemaphores = signalSemaphores;
 
+        CpuScope submitScope(cpuProfiler, "QueueSubmit");
         if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS) {
             throw runtime_error("failed to submit draw command buffer!");
         }
+        submitScope.end();
+        frameSubmitCounts[currentFrame] = ++submittedFrameCount;
+        gpuProfiler.markSubmitted(getProfilerSlot(imageIndex));
+        if (instanceUpdateCommandBuffer != VK_NULL_HANDLE)
+            gpuProfiler.markSubmitted(getInstanceUpdateProfilerSlot());
+
+        if (config.headless)
+        {
+            currentFrame = (currentFrame + 1) % config.framesInFlight;
+            return;
+        }
 
         VkPresentInfoKHR presentInfo{};
         presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -1427,7 +5476,9 @@ private:
 
         presentInfo.pImageIndices = &imageIndex;
 
+        CpuScope presentScope(cpuProfiler, "QueuePresent");
         result = vkQueuePresentKHR(presentQueue, &presentInfo);
+        presentScope.end();
 
         if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebufferResized) 
         {
@@ -1439,18 +5490,170 @@ private:
             throw runtime_error("failed to present swap chain image!");
         }
 
-        currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+        currentFrame = (currentFrame + 1) % config.framesInFlight;
     }
 
 };
 
 
-int main()
+// コマンドライン・設定ファイル共通の「キー=値」の適用
+void applyConfigOption(AppConfig& config, const string& key, const string& value)
+{
+    if (key == "headless")
+    {
+        config.headless = (value != "0" && value != "false");
+    }
+    else if (key == "frames")
+    {
+        config.benchmarkFrames = static_cast<uint32_t>(stoul(value));
+    }
+    else if (key == "trace")
+    {
+        config.traceFile = value;
+    }
+    else if (key == "frames-in-flight")
+    {
+        config.framesInFlight = static_cast<uint32_t>(stoul(value));
+        if (config.framesInFlight == 0 || config.framesInFlight > MAX_FRAMES_IN_FLIGHT_LIMIT)
+        {
+            throw runtime_error("frames-in-flight must be between 1 and " + to_string(MAX_FRAMES_IN_FLIGHT_LIMIT));
+        }
+    }
+    else if (key == "swapchain-images")
+    {
+        config.swapchainImages = static_cast<uint32_t>(stoul(value));
+    }
+    else if (key == "present-mode")
+    {
+        if (value == "latency")
+            config.presentPolicy = PresentPolicy::LowLatency;
+        else if (value == "power")
+            config.presentPolicy = PresentPolicy::PowerSaving;
+        else if (value == "fifo_relaxed")
+            config.presentPolicy = PresentPolicy::FifoRelaxed;
+        else
+            throw runtime_error("unknown present mode: " + value);
+    }
+    else if (key == "fps-limit")
+    {
+        config.fpsLimit = stod(value);
+    }
+    else if (key == "gpu")
+    {
+        config.gpu = value;
+    }
+    else if (key == "record-mode")
+    {
+        if (value == "perframe")
+            config.recordMode = CommandRecordMode::PerFrame;
+        else if (value == "prerecorded")
+            config.recordMode = CommandRecordMode::PreRecorded;
+        else if (value == "secondary")
+            config.recordMode = CommandRecordMode::Secondary;
+        else
+            throw runtime_error("unknown record mode: " + value);
+    }
+    else if (key == "direct-upload")
+    {
+        config.directUpload = (value != "0" && value != "false");
+    }
+    else if (key == "instances")
+    {
+        config.instanceCount = static_cast<uint32_t>(stoul(value));
+        if (config.instanceCount == 0)
+        {
+            throw runtime_error("instances must be at least 1");
+        }
+    }
+    else if (key == "indirect")
+    {
+        config.indirectDraws = (value != "0" && value != "false");
+    }
+    else if (key == "mesh-optimize")
+    {
+        config.meshOptimize = (value != "0" && value != "false");
+    }
+    else if (key == "overdraw-threshold")
+    {
+        config.overdrawThreshold = stof(value);
+        if (config.overdrawThreshold != 0.0f && config.overdrawThreshold < 1.0f)
+        {
+            throw runtime_error("overdraw-threshold must be 0 or at least 1.0");
+        }
+    }
+    else
+    {
+        throw runtime_error("unknown option: " + key);
+    }
+}
+
+void loadConfigFile(AppConfig& config, const string& path)
+{
+    ifstream file(path);
+    if (!file.is_open())
+    {
+        throw runtime_error("failed to open config file: " + path);
+    }
+
+    auto trim = [](const string& text)
+    {
+        size_t first = text.find_first_not_of(" \t\r");
+        size_t last = text.find_last_not_of(" \t\r");
+        return first == string::npos ? string() : text.substr(first, last - first + 1);
+    };
+
+    string line;
+    while (getline(file, line))
+    {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty())
+            continue;
+
+        size_t separator = line.find('=');
+        if (separator == string::npos)
+        {
+            throw runtime_error("invalid line in config file: " + line);
+        }
+
+        applyConfigOption(config, trim(line.substr(0, separator)), trim(line.substr(separator + 1)));
+    }
+}
+
+// 引数は前から順に適用するため、--configより後ろのオプションは設定ファイルの値を上書きする
+AppConfig parseCommandLine(int argc, char* argv[])
 {
-    HelloTriangleApplication app;
+    AppConfig config;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+
+        if (arg == "--headless")
+        {
+            applyConfigOption(config, "headless", "1");
+        }
+        else if (arg == "--config" && i + 1 < argc)
+        {
+            loadConfigFile(config, argv[++i]);
+        }
+        else if (arg.compare(0, 2, "--") == 0 && i + 1 < argc)
+        {
+            applyConfigOption(config, arg.substr(2), argv[++i]);
+        }
+        else
+        {
+            throw runtime_error("unknown argument: " + arg);
+        }
+    }
 
+    return config;
+}
+
+int main(int argc, char* argv[])
+{
     try
     {
+        HelloTriangleApplication app(parseCommandLine(argc, argv));
         app.run();
     }
     catch (const exception& e)
@@ -3,10 +3,15 @@
 layout(location = 0) in vec2 inPosition;
 layout(location = 1) in vec3 inColor;
 
+// インスタンスごとの属性（バインディング1、VK_VERTEX_INPUT_RATE_INSTANCE）
+layout(location = 2) in vec4 inTransform;     // xy: 平行移動 zw: 拡大率
+layout(location = 3) in vec4 inInstanceColor;
+layout(location = 4) in uint inInstanceId;      // オブジェクト番号（現在は未使用）
+
 layout(location = 0) out vec3 fragColor;
 
 void main() 
 {
-    gl_Position = vec4(inPosition, 0.0, 1.0);
-    fragColor = inColor;
+    gl_Position = vec4(inPosition * inTransform.zw + inTransform.xy, 0.0, 1.0);
+    fragColor = inColor * inInstanceColor.rgb;
 }
\ No newline at end of file